@@ -9,6 +9,8 @@ abort "missing library Z80"  unless have_library 'Z80'
 end
 
 have_func 'z80_special_reset'
+have_func 'rb_fiber_scheduler_current', 'ruby/fiber/scheduler.h'
+have_func 'clock_nanosleep', 'time.h'
 
 %w(break r refresh_address in_cycle out_cycle).each do |function|
 	abort "missing z80_#{function}()" unless have_func("z80_#{function}", 'Z80.h')
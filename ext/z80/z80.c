@@ -21,10 +21,17 @@
 
 #include <ruby.h>
 #include <ruby/version.h>
+#include <ruby/thread.h>
 #include <Z80.h>
+#include "z80_ruby.h"
 #include <Z/macros/array.h>
 #include <inttypes.h>
 #include <stdio.h>
+#include <time.h>
+
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+#	include <ruby/fiber/scheduler.h>
+#endif
 
 static rb_data_type_t const z80_data_type;
 
@@ -32,14 +39,157 @@ static rb_data_type_t const z80_data_type;
 	Z80 *z80; \
 	TypedData_Get_Struct(self, Z80, &z80_data_type, z80);
 
-enum {	FetchOpcode, Fetch, Read, Write, In, Out,
+enum {	FetchOpcode = Z80_RUBY_FETCH_OPCODE, Fetch, Read, Write, In, Out,
 	Halt, Nop,
 	NMIA, INTA, INTFetch,
 	ld_i_a, ld_r_a, reti, retn,
 	Hook, Illegal,
-	Context
+	Context = Z80_RUBY_CALLBACK_COUNT
 };
 
+typedef struct {
+	void* function;
+	void* context;
+	VALUE owner;
+} NativeHandler;
+
+typedef struct {
+	zuint16	 port;
+	zuint16	 mask;
+	Z80Read	 in;
+	Z80Write out;
+	void*	 context;
+	VALUE	 owner;
+} PortHandler;
+
+typedef struct {
+	zuint8*	 read;
+	zuint8*	 write;
+	Z80Read	 reader;
+	Z80Write writer;
+	void*	 context;
+	VALUE	 owner;
+} MemoryPage;
+
+typedef struct {
+	zuint16 port;
+	zuint16 mask;
+} PortFilter;
+
+typedef struct {
+	PortFilter* filters;
+	zusize	    filter_count;
+	zuint8*	    data;
+	zusize	    size;
+	zusize	    capacity;
+} OutputLog;
+
+typedef struct {
+	zuint16 port;
+	zuint16 mask;
+	zuint8	bit;
+	zuint8	level;
+	zuint8	centered;
+	zuint16 amplitude;
+	zuint64 clock_hz;
+	zuint64 sample_rate;
+	zuint64 position;
+	zuint64 phase;
+	zuint64 high;
+	zuint8* data;
+	zusize	size;
+	zusize	capacity;
+} Beeper;
+
+typedef struct {
+	zuint64 calls;
+	zuint64 cycles;
+	zuint64 inclusive;
+	zuint32 parent;
+	zuint32 child;
+	zuint32 sibling;
+	zuint16 target;
+} ProfileNode;
+
+typedef struct {
+	zuint32 node;
+	zuint16 sp;
+} ProfileFrame;
+
+typedef struct {
+	Z80Read	      fetch_opcode;
+	ProfileNode*  nodes;
+	zuint32	      node_count;
+	zuint32	      node_capacity;
+	ProfileFrame* frames;
+	zuint32	      frame_count;
+	zuint32	      frame_capacity;
+	zuint64	      last_cycle;
+	zuint16	      pending_sp;
+	zuint8	      pending;
+	zuint8	      prefix;
+	zuint8	      last_iff1;
+	zbool	      disabling;
+	zbool	      active;
+} Profiler;
+
+typedef struct {
+	Z80	state;
+	zuint8* snapshot;
+	zuint	page_count;
+	zuint8* pages[256];
+	zuint8* targets[256];
+	zuint8	dirty[256];
+	zuint8	dirty_pages[256];
+	zuint	dirty_count;
+} Template;
+
+typedef struct {
+	zuint64 slices;
+	zuint64 late_slices;
+	zuint64 skipped_slices;
+	zuint64 total_lag;
+	zuint64 maximum_lag;
+	zsint64	last_lag;
+} RealtimeStats;
+
+typedef struct {
+	VALUE	       external[Context + 1];
+	void*	       callbacks[Context];
+	NativeHandler* native_handlers;
+	PortHandler*   port_handlers;
+	zusize	       port_handler_count;
+	MemoryPage*    memory_pages;
+	zuint	       mapped_page_count;
+	zbool	       terminated;
+	RealtimeStats  realtime_stats;
+	zuint64	       total_cycles;
+	zbool	       running;
+	OutputLog*     output_log;
+	Beeper*	       beeper;
+	Profiler*      profiler;
+	Template*      machine_template;
+} Bindings;
+
+typedef struct {
+	Z80	 z80;
+	Bindings bindings;
+} Machine;
+
+#define BINDINGS_Z80(bindings) \
+	((Z80 *)(void *)((char *)(bindings) - Z_MEMBER_OFFSET(Machine, bindings)))
+
+
+/* Clock cycles elapsed since the object was created. `total_cycles` is only
+ * updated when a run ends, so `cycles` is added while running. Outside a run,
+ * the `cycles` register has no effect on this count. */
+
+static zuint64 current_cycle(Bindings *bindings)
+	{
+	return	bindings->total_cycles +
+		(bindings->running ? BINDINGS_Z80(bindings)->cycles : 0);
+	}
+
 
 /* Callbacks: Dummy Bridges */
 
@@ -123,7 +273,7 @@ static zuint8 receiver##_int_fetch(VALUE *external, zuint16 address)	     \
 static void receiver##_ld_i_a(VALUE *external) {call(ld_i_a, 0);}	     \
 static void receiver##_ld_r_a(VALUE *external) {call(ld_r_a, 0);}	     \
 static void receiver##_reti  (VALUE *external) {call(reti,   0);}	     \
-static void receiver##_retn  (VALUE *external) {call(reti,   0);}	     \
+static void receiver##_retn  (VALUE *external) {call(retn,   0);}	     \
 									     \
 									     \
 static zuint8 receiver##_hook(VALUE *external, zuint16 address)		     \
@@ -142,6 +292,566 @@ CALLBACK_BRIDGES(method, METHOD_CALL)
 #undef CALLBACK_BRIDGES
 
 
+/* MARK: - Callbacks: Native Bridges */
+
+/* Bridges to the handlers installed through the C API (see "z80_ruby.h"),
+ * which are called with their own context instead of the binding's. */
+
+#define NATIVE_HANDLER(index) (bindings->native_handlers + index)
+
+
+#define NATIVE_READ_BRIDGE(callback, index)				  \
+									  \
+static zuint8 native_##callback(Bindings *bindings, zuint16 address)	  \
+	{								  \
+	NativeHandler const *handler = NATIVE_HANDLER(index);		  \
+	return ((Z80Read)handler->function)(handler->context, address);	  \
+	}
+
+
+#define NATIVE_WRITE_BRIDGE(callback, index)					\
+										\
+static void native_##callback(Bindings *bindings, zuint16 address, zuint8 value) \
+	{									\
+	NativeHandler const *handler = NATIVE_HANDLER(index);			\
+	((Z80Write)handler->function)(handler->context, address, value);	\
+	}
+
+
+#define NATIVE_NOTIFY_BRIDGE(callback, index)		      \
+							      \
+static void native_##callback(Bindings *bindings)	      \
+	{						      \
+	NativeHandler const *handler = NATIVE_HANDLER(index); \
+	((Z80Notify)handler->function)(handler->context);     \
+	}
+
+
+NATIVE_READ_BRIDGE  (fetch_opcode, FetchOpcode)
+NATIVE_READ_BRIDGE  (fetch,	   Fetch      )
+NATIVE_READ_BRIDGE  (read,	   Read	      )
+NATIVE_WRITE_BRIDGE (write,	   Write      )
+NATIVE_READ_BRIDGE  (in,	   In	      )
+NATIVE_WRITE_BRIDGE (out,	   Out	      )
+NATIVE_READ_BRIDGE  (nop,	   Nop	      )
+NATIVE_READ_BRIDGE  (nmia,	   NMIA	      )
+NATIVE_READ_BRIDGE  (inta,	   INTA	      )
+NATIVE_READ_BRIDGE  (int_fetch,	   INTFetch   )
+NATIVE_NOTIFY_BRIDGE(ld_i_a,	   ld_i_a     )
+NATIVE_NOTIFY_BRIDGE(ld_r_a,	   ld_r_a     )
+NATIVE_NOTIFY_BRIDGE(reti,	   reti	      )
+NATIVE_NOTIFY_BRIDGE(retn,	   retn	      )
+NATIVE_READ_BRIDGE  (hook,	   Hook	      )
+
+#undef NATIVE_READ_BRIDGE
+#undef NATIVE_WRITE_BRIDGE
+#undef NATIVE_NOTIFY_BRIDGE
+
+
+static void native_halt(Bindings *bindings, zuint8 signal)
+	{
+	NativeHandler const *handler = NATIVE_HANDLER(Halt);
+	((Z80Halt)handler->function)(handler->context, signal);
+	}
+
+
+/* The Z80 library passes the emulator instance to this callback. */
+
+static zuint8 native_illegal(Z80 *z80, zuint8 opcode)
+	{
+	Bindings *bindings = z80->context;
+	NativeHandler const *handler = NATIVE_HANDLER(Illegal);
+
+	return ((Z80RubyIllegal)handler->function)(handler->context, opcode);
+	}
+
+#undef NATIVE_HANDLER
+
+
+/* MARK: - Call Profiler */
+
+/* The profiler keeps a shadow call stack by filtering the opcode fetches. The
+ * stack pointer is compared at the fetch that follows a CALL, RST or RET (or a
+ * RETI or RETN, reported through the `reti` and `retn` slots) to find out
+ * whether the instruction was taken. Interrupt responses are recognized
+ * because they are the only way, other than DI, in which IFF1 is cleared.
+ * Code that discards return addresses or switches stacks is handled by
+ * dropping the frames whose return address lies at or above the stack
+ * pointer when another frame is pushed.
+ *
+ * Cycles are accumulated in a tree of call paths rooted at the code executed
+ * outside any call; each node counts the calls and the exclusive cycles of
+ * one call target reached through one path. */
+
+enum {ProfileNothing, ProfileCall, ProfileReturn};
+
+
+static zuint32 profiler_node(Profiler *profiler, zuint32 parent, zuint16 target)
+	{
+	ProfileNode *node;
+	zuint32 index = profiler->nodes[parent].child;
+
+	for (; index; index = profiler->nodes[index].sibling)
+		if (profiler->nodes[index].target == target) return index;
+
+	if (profiler->node_count == profiler->node_capacity)
+		{
+		profiler->node_capacity *= 2;
+		REALLOC_N(profiler->nodes, ProfileNode, profiler->node_capacity);
+		}
+
+	node = profiler->nodes + (index = profiler->node_count++);
+	node->calls   = 0;
+	node->cycles  = 0;
+	node->parent  = parent;
+	node->child   = 0;
+	node->sibling = profiler->nodes[parent].child;
+	node->target  = target;
+	profiler->nodes[parent].child = index;
+	return index;
+	}
+
+
+static void profiler_charge(Profiler *profiler, zuint64 cycle)
+	{
+	profiler->nodes[profiler->frame_count
+		? profiler->frames[profiler->frame_count - 1].node
+		: 0
+	].cycles += cycle - profiler->last_cycle;
+
+	profiler->last_cycle = cycle;
+	}
+
+
+static void profiler_push(Profiler *profiler, zuint16 target, zuint16 sp, zuint64 cycle)
+	{
+	ProfileFrame *frame;
+	zuint32 node;
+
+	profiler_charge(profiler, cycle);
+
+	while (profiler->frame_count && profiler->frames[profiler->frame_count - 1].sp <= sp)
+		profiler->frame_count--;
+
+	node = profiler_node(
+		profiler,
+		profiler->frame_count ? profiler->frames[profiler->frame_count - 1].node : 0,
+		target);
+
+	profiler->nodes[node].calls++;
+
+	if (profiler->frame_count == profiler->frame_capacity)
+		{
+		profiler->frame_capacity *= 2;
+		REALLOC_N(profiler->frames, ProfileFrame, profiler->frame_capacity);
+		}
+
+	frame = profiler->frames + profiler->frame_count++;
+	frame->node = node;
+	frame->sp   = sp;
+	}
+
+
+static void profiler_pop(Profiler *profiler, zuint16 sp, zuint64 cycle)
+	{
+	profiler_charge(profiler, cycle);
+
+	while (profiler->frame_count && profiler->frames[profiler->frame_count - 1].sp < sp)
+		profiler->frame_count--;
+	}
+
+
+static zuint8 profile_fetch_opcode(Bindings *bindings, zuint16 address)
+	{
+	Profiler *profiler = bindings->profiler;
+	Z80 *z80 = BINDINGS_Z80(bindings);
+	zuint16 sp = Z80_SP(*z80);
+	zuint64 cycle = current_cycle(bindings);
+	zuint8 opcode = profiler->fetch_opcode(bindings, address);
+	zuint8 prefix = profiler->prefix;
+
+	if (profiler->last_iff1 && !z80->iff1 && !profiler->disabling)
+		{
+		/* A return can precede the response to the interrupt. A CALL
+		 * taken right before the response is not recorded, as its
+		 * target is unknown. */
+		if (profiler->pending == ProfileReturn)
+			profiler_pop(profiler, (zuint16)(sp + 2), cycle);
+
+		profiler_push(profiler, address, sp, cycle);
+		}
+
+	else if (profiler->pending == ProfileCall)
+		{
+		if (sp == (zuint16)(profiler->pending_sp - 2))
+			profiler_push(profiler, address, sp, cycle);
+		}
+
+	else if (profiler->pending == ProfileReturn)
+		profiler_pop(profiler, sp, cycle);
+
+	profiler->pending   = ProfileNothing;
+	profiler->prefix    = 0;
+	profiler->last_iff1 = z80->iff1;
+	profiler->disabling = Z_FALSE;
+
+	/* The opcode that follows ED, or CB without a DD or FD prefix, is not a
+	 * main instruction. */
+	if (prefix == 0xED || prefix == 0xCB) return opcode;
+
+	if (opcode == 0xCD || (opcode & 0xC7) == 0xC4 || (opcode & 0xC7) == 0xC7)
+		{
+		profiler->pending    = ProfileCall;
+		profiler->pending_sp = sp;
+		}
+
+	else if (opcode == 0xC9 || (opcode & 0xC7) == 0xC0)
+		profiler->pending = ProfileReturn;
+
+	else if (opcode == 0xF3) profiler->disabling = Z_TRUE;
+
+	else if (opcode == 0xCB)
+		profiler->prefix = prefix == 0xDD || prefix == 0xFD ? 0 : 0xCB;
+
+	else if (opcode == 0xED || opcode == 0xDD || opcode == 0xFD)
+		profiler->prefix = opcode;
+
+	return opcode;
+	}
+
+
+static void profile_reti(Bindings *bindings)
+	{
+	bindings->profiler->pending = ProfileReturn;
+
+	if (bindings->callbacks[reti] != NULL)
+		((Z80Notify)bindings->callbacks[reti])(bindings);
+	}
+
+
+static void profile_retn(Bindings *bindings)
+	{
+	bindings->profiler->pending = ProfileReturn;
+
+	if (bindings->callbacks[retn] != NULL)
+		((Z80Notify)bindings->callbacks[retn])(bindings);
+	}
+
+
+static void update_return_bridges(Z80 *z80)
+	{
+	Bindings *bindings = z80->context;
+
+	if (bindings->profiler != NULL && bindings->profiler->active)
+		{
+		z80->reti = (Z80Notify)profile_reti;
+		z80->retn = (Z80Notify)profile_retn;
+		}
+
+	else	{
+		z80->reti = (Z80Notify)bindings->callbacks[reti];
+		z80->retn = (Z80Notify)bindings->callbacks[retn];
+		}
+	}
+
+
+/* MARK: - Memory Pages */
+
+/* The 64 KiB address space is divided into 256 pages of 256 bytes, each of
+ * which can be mapped to a region of a `Z80::Memory` or to a native memory
+ * handler. The page table is only allocated once something is mapped;
+ * accesses to unmapped pages fall through to the memory callbacks. */
+
+#define MEMORY_PAGE_SIZE 256
+
+
+#define MEMORY_READER(callback, index)					\
+									\
+static zuint8 memory_##callback(Bindings *bindings, zuint16 address)	\
+	{								\
+	MemoryPage const *page = bindings->memory_pages + (address >> 8); \
+									\
+	if (page->read	 != NULL) return page->read[address & 0xFF];	\
+	if (page->reader != NULL) return page->reader(page->context, address); \
+	return ((Z80Read)bindings->callbacks[index])(bindings, address); \
+	}
+
+
+MEMORY_READER(fetch_opcode, FetchOpcode)
+MEMORY_READER(fetch,	    Fetch      )
+MEMORY_READER(read,	    Read       )
+
+#undef MEMORY_READER
+
+
+static void memory_write(Bindings *bindings, zuint16 address, zuint8 value)
+	{
+	MemoryPage const *page = bindings->memory_pages + (address >> 8);
+
+	if (page->write != NULL) page->write[address & 0xFF] = value;
+	else if (page->writer != NULL) page->writer(page->context, address, value);
+
+	else if (page->read == NULL && page->reader == NULL)
+		((Z80Write)bindings->callbacks[Write])(bindings, address, value);
+	}
+
+
+/* Used instead of `memory_write` while there is a template, to record the
+ * pages of native memory written since it was captured or last restored. */
+
+static void memory_write_tracking(Bindings *bindings, zuint16 address, zuint8 value)
+	{
+	Template *machine_template = bindings->machine_template;
+	zuint8 index = address >> 8;
+
+	if (bindings->memory_pages[index].write != NULL && !machine_template->dirty[index])
+		{
+		machine_template->dirty[index] = 1;
+		machine_template->dirty_pages[machine_template->dirty_count++] = index;
+		}
+
+	memory_write(bindings, address, value);
+	}
+
+
+static void update_memory_bridges(Z80 *z80)
+	{
+	Bindings *bindings = z80->context;
+
+	if (bindings->mapped_page_count)
+		{
+		z80->fetch_opcode = (Z80Read )memory_fetch_opcode;
+		z80->fetch	  = (Z80Read )memory_fetch;
+		z80->read	  = (Z80Read )memory_read;
+
+		z80->write = bindings->machine_template != NULL
+			? (Z80Write)memory_write_tracking
+			: (Z80Write)memory_write;
+		}
+
+	else	{
+		z80->fetch_opcode = (Z80Read )bindings->callbacks[FetchOpcode];
+		z80->fetch	  = (Z80Read )bindings->callbacks[Fetch	     ];
+		z80->read	  = (Z80Read )bindings->callbacks[Read	     ];
+		z80->write	  = (Z80Write)bindings->callbacks[Write	     ];
+		}
+
+	if (bindings->profiler != NULL && bindings->profiler->active)
+		{
+		bindings->profiler->fetch_opcode = z80->fetch_opcode;
+		z80->fetch_opcode = (Z80Read)profile_fetch_opcode;
+		}
+	}
+
+
+/* MARK: - Output Taps */
+
+/* The output log and the beeper observe the writes to I/O ports before they
+ * reach the port handlers or the `out` callback. Events are stamped with the
+ * clock cycle at which the I/O write M-cycle begins, counted since the object
+ * was created (see `Z80#total_cycles`). */
+
+#define OUT_EVENT_SIZE 12
+
+
+static zuint8 *reserve_bytes(zuint8 **data, zusize *capacity, zusize size, zusize amount)
+	{
+	if (size + amount > *capacity)
+		{
+		zusize new_capacity = *capacity ? *capacity : 1024;
+
+		while (new_capacity < size + amount) new_capacity *= 2;
+		REALLOC_N(*data, zuint8, new_capacity);
+		*capacity = new_capacity;
+		}
+
+	return *data + size;
+	}
+
+
+/* The beeper integrates the level of the speaker over each sample period (a
+ * box filter). Time is measured in units of 1 / (clock_hz * sample_rate)
+ * seconds, so that both a clock cycle (`sample_rate` units) and a sample
+ * (`clock_hz` units) are integral and no error accumulates. The samples go
+ * from 0 (bit low during the whole period) to +amplitude (bit high), so that
+ * an idle speaker is silent. Centered samples go from -amplitude to
+ * +amplitude instead. */
+
+static void beeper_advance(Beeper *beeper, zuint64 cycle)
+	{
+	zuint64 units;
+
+	if (cycle <= beeper->position) return;
+	units = (cycle - beeper->position) * beeper->sample_rate;
+	beeper->position = cycle;
+
+	while (beeper->phase + units >= beeper->clock_hz)
+		{
+		zuint64 span = beeper->clock_hz - beeper->phase;
+		zuint8 *sample = reserve_bytes(&beeper->data, &beeper->capacity, beeper->size, 2);
+		zuint16 value;
+
+		if (beeper->level) beeper->high += span;
+
+		value = beeper->centered
+			? (zuint16)(zsint16)(
+				(zsint64)(beeper->high * 2 * beeper->amplitude / beeper->clock_hz) -
+				(zsint64)beeper->amplitude)
+			: (zuint16)(beeper->high * beeper->amplitude / beeper->clock_hz);
+		sample[0] = (zuint8)value;
+		sample[1] = (zuint8)(value >> 8);
+		beeper->size += 2;
+		units -= span;
+		beeper->phase = beeper->high = 0;
+		}
+
+	beeper->phase += units;
+	if (beeper->level) beeper->high += units;
+	}
+
+
+static void tap_out(Bindings *bindings, zuint16 port, zuint8 value)
+	{
+	Z80 *z80 = BINDINGS_Z80(bindings);
+	zuint64 cycle = current_cycle(bindings) + z80_out_cycle(z80);
+	OutputLog *log = bindings->output_log;
+	Beeper *beeper = bindings->beeper;
+
+	if (log != NULL)
+		{
+		PortFilter const *filter = log->filters;
+		PortFilter const *end = filter + log->filter_count;
+
+		for (; filter != end; filter++) if ((port & filter->mask) == filter->port)
+			{
+			zuint8 *event = reserve_bytes(&log->data, &log->capacity, log->size, OUT_EVENT_SIZE);
+			int i = 0;
+
+			for (; i < 8; i++) event[i] = (zuint8)(cycle >> (i * 8));
+			event[8]  = (zuint8)port;
+			event[9]  = (zuint8)(port >> 8);
+			event[10] = value;
+			event[11] = 0;
+			log->size += OUT_EVENT_SIZE;
+			break;
+			}
+		}
+
+	if (	beeper != NULL && (port & beeper->mask) == beeper->port &&
+		!(value & beeper->bit) != !beeper->level
+	)
+		{
+		beeper_advance(beeper, cycle);
+		beeper->level = !beeper->level;
+		}
+	}
+
+
+/* MARK: - Port Handlers */
+
+/* Native devices attached to I/O ports take precedence over the `in` and `out`
+ * callbacks. A handler matches when `(port & mask) == handler->port`; the
+ * first matching handler wins, and unmatched accesses fall through to the
+ * callbacks. */
+
+static zuint8 port_in(Bindings *bindings, zuint16 port)
+	{
+	PortHandler const *handler = bindings->port_handlers;
+	PortHandler const *end = handler + bindings->port_handler_count;
+
+	for (; handler != end; handler++)
+		if (handler->in != NULL && (port & handler->mask) == handler->port)
+			return handler->in(handler->context, port);
+
+	return ((Z80Read)bindings->callbacks[In])(bindings, port);
+	}
+
+
+static void port_out(Bindings *bindings, zuint16 port, zuint8 value)
+	{
+	PortHandler const *handler = bindings->port_handlers;
+	PortHandler const *end = handler + bindings->port_handler_count;
+
+	if (bindings->output_log != NULL || bindings->beeper != NULL)
+		tap_out(bindings, port, value);
+
+	for (; handler != end; handler++)
+		if (handler->out != NULL && (port & handler->mask) == handler->port)
+			{
+			handler->out(handler->context, port, value);
+			return;
+			}
+
+	((Z80Write)bindings->callbacks[Out])(bindings, port, value);
+	}
+
+
+static void update_port_bridges(Z80 *z80)
+	{
+	Bindings *bindings = z80->context;
+
+	if (bindings->port_handler_count)
+		{
+		z80->in	 = (Z80Read )port_in;
+		z80->out = (Z80Write)port_out;
+		}
+
+	else	{
+		z80->in	 = (Z80Read)bindings->callbacks[In];
+
+		z80->out = bindings->output_log != NULL || bindings->beeper != NULL
+			? (Z80Write)port_out
+			: (Z80Write)bindings->callbacks[Out];
+		}
+	}
+
+
+static void add_port_handler(
+	VALUE	 self,
+	zuint16	 port,
+	zuint16	 mask,
+	Z80Read	 in,
+	Z80Write out,
+	void*	 context,
+	VALUE	 owner
+)
+	{
+	Bindings *bindings;
+	PortHandler *handler;
+	GET_Z80;
+
+	bindings = z80->context;
+	REALLOC_N(bindings->port_handlers, PortHandler, bindings->port_handler_count + 1);
+	handler = bindings->port_handlers + bindings->port_handler_count++;
+	handler->port	 = port & mask;
+	handler->mask	 = mask;
+	handler->in	 = in;
+	handler->out	 = out;
+	handler->context = context;
+	RB_OBJ_WRITE(self, &handler->owner, owner);
+	update_port_bridges(z80);
+	}
+
+
+static void remove_port_handlers(Z80 *z80, VALUE owner)
+	{
+	Bindings *bindings = z80->context;
+	PortHandler *handlers = bindings->port_handlers;
+	zusize i = 0, j = 0;
+
+	for (; i < bindings->port_handler_count; i++)
+		if (handlers[i].owner != owner) handlers[j++] = handlers[i];
+
+	if (!(bindings->port_handler_count = j))
+		{
+		xfree(handlers);
+		bindings->port_handlers = NULL;
+		}
+
+	update_port_bridges(z80);
+	}
+
+
 /* MARK: - Callbacks: Accessors */
 
 typedef struct {
@@ -149,41 +859,63 @@ typedef struct {
 	void*  dummy;
 	void*  proc_bridge;
 	void*  method_bridge;
+	void*  native_bridge;
 } CallbackInfo;
 
 static CallbackInfo const callback_info_table[] = {
-	{Z_MEMBER_OFFSET(Z80, fetch_opcode), dummy_read,  proc_fetch_opcode, method_fetch_opcode},
-	{Z_MEMBER_OFFSET(Z80, fetch	  ), dummy_read,  proc_fetch,	     method_fetch,	},
-	{Z_MEMBER_OFFSET(Z80, read	  ), dummy_read,  proc_read,	     method_read,	},
-	{Z_MEMBER_OFFSET(Z80, write	  ), dummy_write, proc_write,	     method_write,	},
-	{Z_MEMBER_OFFSET(Z80, in	  ), dummy_read,  proc_in,	     method_in,		},
-	{Z_MEMBER_OFFSET(Z80, out	  ), dummy_write, proc_out,	     method_out,	},
-	{Z_MEMBER_OFFSET(Z80, halt	  ), NULL,	  proc_halt,	     method_halt,	},
-	{Z_MEMBER_OFFSET(Z80, nop	  ), NULL,	  proc_nop,	     method_nop,	},
-	{Z_MEMBER_OFFSET(Z80, nmia	  ), NULL,	  proc_nmia,	     method_nmia,	},
-	{Z_MEMBER_OFFSET(Z80, inta	  ), NULL,	  proc_inta,	     method_inta,	},
-	{Z_MEMBER_OFFSET(Z80, int_fetch	  ), NULL,	  proc_int_fetch,    method_int_fetch,	},
-	{Z_MEMBER_OFFSET(Z80, ld_i_a	  ), NULL,	  proc_ld_i_a,	     method_ld_i_a,	},
-	{Z_MEMBER_OFFSET(Z80, ld_r_a	  ), NULL,	  proc_ld_r_a,	     method_ld_r_a,	},
-	{Z_MEMBER_OFFSET(Z80, reti	  ), NULL,	  proc_reti,	     method_reti,	},
-	{Z_MEMBER_OFFSET(Z80, retn	  ), NULL,	  proc_retn,	     method_retn,	},
-	{Z_MEMBER_OFFSET(Z80, hook	  ), NULL,	  proc_hook,	     method_hook,	},
-	{Z_MEMBER_OFFSET(Z80, illegal	  ), NULL,	  proc_illegal,	     method_illegal,	}};
+	{Z_MEMBER_OFFSET(Z80, fetch_opcode), dummy_read,  proc_fetch_opcode, method_fetch_opcode, native_fetch_opcode},
+	{Z_MEMBER_OFFSET(Z80, fetch	  ), dummy_read,  proc_fetch,	     method_fetch,	  native_fetch	     },
+	{Z_MEMBER_OFFSET(Z80, read	  ), dummy_read,  proc_read,	     method_read,	  native_read	     },
+	{Z_MEMBER_OFFSET(Z80, write	  ), dummy_write, proc_write,	     method_write,	  native_write	     },
+	{Z_MEMBER_OFFSET(Z80, in	  ), dummy_read,  proc_in,	     method_in,		  native_in	     },
+	{Z_MEMBER_OFFSET(Z80, out	  ), dummy_write, proc_out,	     method_out,	  native_out	     },
+	{Z_MEMBER_OFFSET(Z80, halt	  ), NULL,	  proc_halt,	     method_halt,	  native_halt	     },
+	{Z_MEMBER_OFFSET(Z80, nop	  ), NULL,	  proc_nop,	     method_nop,	  native_nop	     },
+	{Z_MEMBER_OFFSET(Z80, nmia	  ), NULL,	  proc_nmia,	     method_nmia,	  native_nmia	     },
+	{Z_MEMBER_OFFSET(Z80, inta	  ), NULL,	  proc_inta,	     method_inta,	  native_inta	     },
+	{Z_MEMBER_OFFSET(Z80, int_fetch	  ), NULL,	  proc_int_fetch,    method_int_fetch,	  native_int_fetch   },
+	{Z_MEMBER_OFFSET(Z80, ld_i_a	  ), NULL,	  proc_ld_i_a,	     method_ld_i_a,	  native_ld_i_a	     },
+	{Z_MEMBER_OFFSET(Z80, ld_r_a	  ), NULL,	  proc_ld_r_a,	     method_ld_r_a,	  native_ld_r_a	     },
+	{Z_MEMBER_OFFSET(Z80, reti	  ), NULL,	  proc_reti,	     method_reti,	  native_reti	     },
+	{Z_MEMBER_OFFSET(Z80, retn	  ), NULL,	  proc_retn,	     method_retn,	  native_retn	     },
+	{Z_MEMBER_OFFSET(Z80, hook	  ), NULL,	  proc_hook,	     method_hook,	  native_hook	     },
+	{Z_MEMBER_OFFSET(Z80, illegal	  ), NULL,	  proc_illegal,	     method_illegal,	  native_illegal     }};
+
+
+/* Selects the bridge of a callback slot: a native handler has priority over
+ * the Ruby callback, and the dummy is used when there is none. The memory and
+ * port bridges sit in front of the slot and fall back to this bridge. */
+
+static void update_callback(Z80 *z80, zuint index)
+	{
+	Bindings *bindings = z80->context;
+	CallbackInfo const *callback_info = callback_info_table + index;
+
+	bindings->callbacks[index] =
+		bindings->native_handlers != NULL &&
+		bindings->native_handlers[index].function != NULL
+			? callback_info->native_bridge
+			: (bindings->external[index] != Qnil
+				? callback_info->proc_bridge
+				: callback_info->dummy);
+
+	if (index <= Write) update_memory_bridges(z80);
+	else if (index == In || index == Out) update_port_bridges(z80);
+	else if (index == reti || index == retn) update_return_bridges(z80);
+
+	else *(void **)((char *)z80 + callback_info->offset) =
+		bindings->callbacks[index];
+	}
 
 
 static void set_callback(VALUE self, VALUE object, zuint index)
 	{
-	CallbackInfo const *callback_info;
 	VALUE *external;
 	GET_Z80;
 
 	external = (VALUE *)z80->context + index;
-	*external = object;
-	callback_info = callback_info_table + index;
-
-	*(void **)((char *)z80 + callback_info->offset) = object != Qnil
-		? *(void **)((char *)z80 + callback_info->offset) = callback_info->proc_bridge
-		: callback_info->dummy;
+	RB_OBJ_WRITE(self, external, object);
+	update_callback(z80, index);
 	}
 
 
@@ -230,7 +962,7 @@ CALLBACK_ACCESSOR(illegal,	Illegal	   )
 static VALUE Z80__set_context(VALUE self, VALUE context)
 	{
 	GET_Z80;
-	*((VALUE *)z80->context + Context) = context;
+	RB_OBJ_WRITE(self, (VALUE *)z80->context + Context, context);
 	return Qnil;
 	}
 
@@ -437,249 +1169,2140 @@ static VALUE Z80__nmi(VALUE self)
 	}
 
 
-static VALUE Z80__execute(VALUE self, VALUE cycles)
+/* The cycles of each run are accumulated into `total_cycles` when the run
+ * ends (see `current_cycle`). A run that was interrupted by an exception
+ * raised in a callback is accounted for when the next one starts.
+ *
+ * IFF1 may have been changed between runs (`iff1=`, `power`, `to_h`...), so
+ * the profiler resynchronizes with it to not take the change for the
+ * response to an interrupt. */
+
+static void begin_run(Bindings *bindings, Z80 const *z80)
 	{
-	GET_Z80;
-	return SIZET2NUM(z80_execute(z80, NUM2SIZET(cycles)));
+	Profiler *profiler = bindings->profiler;
+
+	if (bindings->running) bindings->total_cycles += z80->cycles;
+	bindings->running = Z_TRUE;
+
+	if (profiler != NULL && profiler->active)
+		{
+		profiler->last_iff1 = z80->iff1;
+		profiler->disabling = Z_FALSE;
+		}
 	}
 
 
-static VALUE Z80__run(VALUE self, VALUE cycles)
+static zusize end_run(Bindings *bindings, zusize executed)
 	{
-	GET_Z80;
-	return SIZET2NUM(z80_run(z80, NUM2SIZET(cycles)));
+	bindings->running = Z_FALSE;
+	bindings->total_cycles += executed;
+	return executed;
 	}
 
 
-static VALUE Z80__terminate(VALUE self)
+static zusize run_z80(Z80 *z80, zusize cycles)
 	{
-	GET_Z80;
+	begin_run(z80->context, z80);
+	return end_run(z80->context, z80_run(z80, cycles));
+	}
+
+
+static zusize execute_z80(Z80 *z80, zusize cycles)
+	{
+	begin_run(z80->context, z80);
+	return end_run(z80->context, z80_execute(z80, cycles));
+	}
+
+
+static VALUE Z80__execute(VALUE self, VALUE cycles)
+	{
+	GET_Z80;
+	return SIZET2NUM(execute_z80(z80, NUM2SIZET(cycles)));
+	}
+
+
+static VALUE Z80__run(VALUE self, VALUE cycles)
+	{
+	GET_Z80;
+	return SIZET2NUM(run_z80(z80, NUM2SIZET(cycles)));
+	}
+
+
+static VALUE Z80__total_cycles(VALUE self)
+	{
+	GET_Z80;
+	return ULL2NUM(current_cycle(z80->context));
+	}
+
+
+/* Sliced runs run `cycles` in slices of `slice` clock cycles and give other
+ * fibers or threads a chance to run between slices. If a `time` (in seconds)
+ * is specified, slices are grouped until at least that much wall-clock time
+ * has passed. Since the Z80 library restarts `cycles` at each slice, callbacks
+ * see it relative to the current slice. `Z80#terminate` stops the run at the
+ * end of the current slice even when called while the run is yielding. */
+
+#define DEFAULT_SLICE 10000
+
+
+static zuint64 monotonic_ns(void)
+	{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (zuint64)now.tv_sec * 1000000000 + (zuint64)now.tv_nsec;
+	}
+
+
+static void yield_to_scheduler(void)
+	{
+#	ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+		VALUE scheduler = rb_fiber_scheduler_current();
+
+		if (scheduler != Qnil)
+			{
+			rb_fiber_scheduler_kernel_sleep(scheduler, INT2FIX(0));
+			return;
+			}
+#	endif
+
+	rb_thread_schedule();
+	}
+
+
+static VALUE Z80__run_cooperatively(int argc, VALUE *argv, VALUE self)
+	{
+	static ID keywords[2];
+	VALUE cycles, options, values[2];
+	Bindings *bindings;
+	zusize total, slice = DEFAULT_SLICE, executed = 0;
+	zuint64 time_slice = 0, slice_start;
+	GET_Z80;
+
+	if (!keywords[0])
+		{
+		keywords[0] = rb_intern("slice");
+		keywords[1] = rb_intern("time");
+		}
+
+	rb_scan_args(argc, argv, "1:", &cycles, &options);
+	rb_get_kwargs(options, keywords, 0, 2, values);
+	total = NUM2SIZET(cycles);
+	if (values[0] != Qundef && !(slice = NUM2SIZET(values[0])))
+		rb_raise(rb_eArgError, "slice must be greater than 0");
+
+	if (values[1] != Qundef)
+		{
+		double seconds = NUM2DBL(values[1]);
+
+		/* Also rejects NaN. The upper bound keeps the conversion in range. */
+		if (!(seconds >= 0.0 && seconds <= 1E9))
+			rb_raise(rb_eArgError, "time out of range (expected 0..1e9 seconds)");
+
+		time_slice = (zuint64)(seconds * 1E9);
+		}
+	bindings = z80->context;
+	bindings->terminated = Z_FALSE;
+	slice_start = time_slice ? monotonic_ns() : 0;
+
+	while (executed < total)
+		{
+		zusize request = total - executed > slice ? slice : total - executed;
+		zusize slice_cycles = run_z80(z80, request);
+
+		executed += slice_cycles;
+		if (slice_cycles < request || executed >= total) break;
+		if (time_slice && monotonic_ns() - slice_start < time_slice) continue;
+		rb_thread_check_ints();
+		yield_to_scheduler();
+		if (bindings->terminated) break;
+		if (time_slice) slice_start = monotonic_ns();
+		}
+
+	return SIZET2NUM(executed);
+	}
+
+
+/* Real-time runs pace the emulation against the monotonic clock: after each
+ * slice, the thread sleeps (without holding the GVL) until the wall-clock time
+ * that corresponds to the cycles executed so far at `clock_hz`. The lag is the
+ * difference between the end of a slice and that deadline. When the
+ * emulation falls behind, the `:catch_up` policy runs the next slices without
+ * sleeping until it recovers, whereas `:skip` gives up the lost time once it
+ * exceeds a slice. Execution itself keeps the GVL, as the callbacks may need
+ * it. */
+
+static zuint64 cycles_to_ns(zuint64 cycles, zuint64 clock_hz)
+	{
+	return	cycles / clock_hz * 1000000000 +
+		cycles % clock_hz * 1000000000 / clock_hz;
+	}
+
+
+static void *sleep_until(void *deadline)
+	{
+#	ifdef HAVE_CLOCK_NANOSLEEP
+		struct timespec time;
+
+		time.tv_sec  = (time_t)(*(zuint64 *)deadline / 1000000000);
+		time.tv_nsec = (long  )(*(zuint64 *)deadline % 1000000000);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &time, NULL);
+#	else
+		zuint64 now = monotonic_ns();
+
+		if (now < *(zuint64 *)deadline)
+			{
+			struct timespec time;
+			zuint64 delay = *(zuint64 *)deadline - now;
+
+			time.tv_sec  = (time_t)(delay / 1000000000);
+			time.tv_nsec = (long  )(delay % 1000000000);
+			nanosleep(&time, NULL);
+			}
+#	endif
+
+	return NULL;
+	}
+
+
+static VALUE Z80__run_realtime(int argc, VALUE *argv, VALUE self)
+	{
+	static ID keywords[3];
+	VALUE cycles, options, values[3];
+	RealtimeStats *stats;
+	zusize total, slice, executed = 0;
+	zuint64 clock_hz, slice_ns, start;
+	zbool skip = Z_FALSE;
+	GET_Z80;
+
+	if (!keywords[0])
+		{
+		keywords[0] = rb_intern("clock_hz");
+		keywords[1] = rb_intern("slice");
+		keywords[2] = rb_intern("policy");
+		}
+
+	rb_scan_args(argc, argv, "01:", &cycles, &options);
+	rb_get_kwargs(options, keywords, 2, 1, values);
+	total = cycles == Qnil ? Z80_MAXIMUM_CYCLES : NUM2SIZET(cycles);
+	if (!(clock_hz = NUM2ULL(values[0]))) rb_raise(rb_eArgError, "clock_hz must be greater than 0");
+	if (!(slice = NUM2SIZET(values[1]))) rb_raise(rb_eArgError, "slice must be greater than 0");
+
+	if (values[2] != Qundef && values[2] != ID2SYM(rb_intern("catch_up")))
+		{
+		if (values[2] != ID2SYM(rb_intern("skip"))) rb_raise(
+			rb_eArgError, "invalid policy (expected :catch_up or :skip)");
+
+		skip = Z_TRUE;
+		}
+
+	/* Lag is measured in slices under the :skip policy. */
+	if (!(slice_ns = cycles_to_ns(slice, clock_hz)))
+		rb_raise(rb_eArgError, "slice must last at least 1 ns at clock_hz");
+	stats = &((Bindings *)z80->context)->realtime_stats;
+	memset(stats, 0, sizeof(RealtimeStats));
+	((Bindings *)z80->context)->terminated = Z_FALSE;
+	start = monotonic_ns();
+
+	while (executed < total)
+		{
+		zusize request = total - executed > slice ? slice : total - executed;
+		zusize slice_cycles = run_z80(z80, request);
+		zuint64 deadline, now;
+		zsint64 lag;
+
+		executed += slice_cycles;
+		now = monotonic_ns();
+		deadline = start + cycles_to_ns(executed, clock_hz);
+		lag = (zsint64)(now - deadline);
+		stats->slices++;
+		stats->last_lag = lag;
+
+		if (lag > 0)
+			{
+			stats->late_slices++;
+			stats->total_lag += (zuint64)lag;
+			if ((zuint64)lag > stats->maximum_lag) stats->maximum_lag = (zuint64)lag;
+			}
+
+		if (rb_block_given_p()) rb_yield(DBL2NUM(lag / 1E9));
+
+		if (slice_cycles < request || ((Bindings *)z80->context)->terminated)
+			break;
+
+		if (lag < 0) while (monotonic_ns() < deadline)
+			{
+			rb_thread_call_without_gvl(sleep_until, &deadline, RUBY_UBF_IO, NULL);
+			rb_thread_check_ints();
+			}
+
+		else if (skip && (zuint64)lag > slice_ns)
+			{
+			stats->skipped_slices += (zuint64)lag / slice_ns;
+			start += (zuint64)lag;
+			}
+
+		/* Late slices run back to back, so interrupts must also be
+		 * checked when there is no sleep. */
+		rb_thread_check_ints();
+		}
+
+	return SIZET2NUM(executed);
+	}
+
+
+static VALUE Z80__realtime_stats(VALUE self)
+	{
+	RealtimeStats const *stats;
+	VALUE hash;
+	GET_Z80;
+
+	stats = &((Bindings const *)z80->context)->realtime_stats;
+	hash = rb_hash_new();
+	rb_hash_aset(hash, ID2SYM(rb_intern("slices")),		ULL2NUM(stats->slices));
+	rb_hash_aset(hash, ID2SYM(rb_intern("late_slices")),	ULL2NUM(stats->late_slices));
+	rb_hash_aset(hash, ID2SYM(rb_intern("skipped_slices")), ULL2NUM(stats->skipped_slices));
+	rb_hash_aset(hash, ID2SYM(rb_intern("last_lag")),	DBL2NUM(stats->last_lag / 1E9));
+	rb_hash_aset(hash, ID2SYM(rb_intern("maximum_lag")),	DBL2NUM(stats->maximum_lag / 1E9));
+
+	rb_hash_aset(
+		hash, ID2SYM(rb_intern("mean_lag")),
+		DBL2NUM(stats->slices ? stats->total_lag / 1E9 / stats->slices : 0.0));
+
+	return hash;
+	}
+
+
+static VALUE Z80__terminate(VALUE self)
+	{
+	GET_Z80;
 	z80_break(z80);
+	((Bindings *)z80->context)->terminated = Z_TRUE;
 	return self;
 	}
 
 
-static VALUE Z80__full_r(VALUE self)
+static VALUE Z80__full_r(VALUE self)
+	{
+	GET_Z80;
+	return UINT2NUM(z80_r(z80));
+	}
+
+
+static VALUE Z80__refresh_address(VALUE self)
+	{
+	GET_Z80;
+	return UINT2NUM(z80_refresh_address(z80));
+	}
+
+
+static VALUE Z80__in_cycle(VALUE self)
+	{
+	GET_Z80;
+	return UINT2NUM(z80_in_cycle(z80));
+	}
+
+
+static VALUE Z80__out_cycle(VALUE self)
+	{
+	GET_Z80;
+	return UINT2NUM(z80_out_cycle(z80));
+	}
+
+
+static struct {char const* name; zuint offset;} const
+
+uint16_members[] = {
+	{"memptr", Z_MEMBER_OFFSET(Z80, memptr	)},
+	{"pc",	   Z_MEMBER_OFFSET(Z80, pc	)},
+	{"sp",	   Z_MEMBER_OFFSET(Z80, sp	)},
+	{"xy",	   Z_MEMBER_OFFSET(Z80, xy	)},
+	{"ix",	   Z_MEMBER_OFFSET(Z80, ix_iy[0])},
+	{"iy",	   Z_MEMBER_OFFSET(Z80, ix_iy[1])},
+	{"af",	   Z_MEMBER_OFFSET(Z80, af	)},
+	{"bc",	   Z_MEMBER_OFFSET(Z80, bc	)},
+	{"de",	   Z_MEMBER_OFFSET(Z80, de	)},
+	{"hl",	   Z_MEMBER_OFFSET(Z80, hl	)},
+	{"af_",	   Z_MEMBER_OFFSET(Z80, af_	)},
+	{"bc_",	   Z_MEMBER_OFFSET(Z80, bc_	)},
+	{"de_",	   Z_MEMBER_OFFSET(Z80, de_	)},
+	{"hl_",	   Z_MEMBER_OFFSET(Z80, hl_	)}},
+
+uint8_members[] = {
+	{"i",	      Z_MEMBER_OFFSET(Z80, i	    )},
+	{"r",	      Z_MEMBER_OFFSET(Z80, r	    )},
+	{"r7",	      Z_MEMBER_OFFSET(Z80, r7	    )},
+	{"q",	      Z_MEMBER_OFFSET(Z80, q	    )},
+	{"im",	      Z_MEMBER_OFFSET(Z80, im	    )},
+	{"request",   Z_MEMBER_OFFSET(Z80, request  )},
+	{"resume",    Z_MEMBER_OFFSET(Z80, resume   )},
+	{"options",   Z_MEMBER_OFFSET(Z80, options  )},
+	{"iff1",      Z_MEMBER_OFFSET(Z80, iff1	    )},
+	{"iff2",      Z_MEMBER_OFFSET(Z80, iff2	    )},
+	{"int_line",  Z_MEMBER_OFFSET(Z80, int_line )},
+	{"halt_line", Z_MEMBER_OFFSET(Z80, halt_line)}};
+
+
+static VALUE Z80__to_h(int argc, VALUE *argv, VALUE self)
+	{
+	Z80 *z80;
+	VALUE hash;
+	VALUE kv[(Z_ARRAY_SIZE(uint16_members) + Z_ARRAY_SIZE(uint8_members)) * 2];
+	int i, j, uint8_member_count;
+
+	if (argc > 1) rb_raise(
+		rb_eArgError,
+		"wrong number of arguments (given %d, expected 0 or 1)",
+		argc);
+
+	TypedData_Get_Struct(self, Z80, &z80_data_type, z80);
+	hash = rb_hash_new();
+
+	uint8_member_count =
+		Z_ARRAY_SIZE(uint8_members) -
+		((argc && RB_TEST(argv[0])) << 2); /* 4 or 0 */
+
+	for (i = j = 0; j < Z_ARRAY_SIZE(uint16_members);)
+		{
+		kv[i++] = rb_id2sym(rb_intern(uint16_members[j].name));
+		kv[i++] = UINT2NUM(*(zuint16 *)(void *)((char *)z80 + uint16_members[j++].offset));
+		}
+
+	for (j = 0; j < uint8_member_count;)
+		{
+		kv[i++] = rb_id2sym(rb_intern(uint8_members[j].name));
+		kv[i++] = UINT2NUM(*((zuint8 *)z80 + uint8_members[j++].offset));
+		}
+
+	while (j < Z_ARRAY_SIZE(uint8_members))
+		{
+		kv[i++] = rb_id2sym(rb_intern(uint8_members[j].name));
+		kv[i++] = *((zuint8 *)z80 + uint8_members[j++].offset) ? Qtrue : Qfalse;
+		}
+
+	rb_hash_bulk_insert_into_st_table(Z_ARRAY_SIZE(kv), kv, hash);
+	return hash;
+	}
+
+
+static char const one_hyphen[2] = "1-";
+
+
+static VALUE Z80__print(VALUE self)
+	{
+	zuint8 f;
+	GET_Z80;
+	f = Z80_F(*z80);
+
+	/*
+	PC 0000  AF 0000  AF' 0000  IX 0000
+	SP 0000  BC 0000  BC' 0000  IY 0000
+	IR 0000  DE 0000  DE' 0000  XY 0000
+	WZ 0000  HL 0000  HL' 0000  Q  00
+	S Z Y H X P N C  IFF1 0  IM 0  EI 1
+	- - 1 - - 1 - -  IFF2 0  R7 0  RI 1
+	/INT  high  RS 00  data 00 00 00 00
+	/HALT high  RQ 00  data 00 00 00 00*/
+
+	printf(	"PC %04" PRIX16		   "  AF %04" PRIX16 "  AF' %04" PRIX16 "  IX %04" PRIX16 "\n"
+		"SP %04" PRIX16		   "  BC %04" PRIX16 "  BC' %04" PRIX16 "  IY %04" PRIX16 "\n"
+		"IR %02" PRIX8 "%02" PRIX8 "  DE %04" PRIX16 "  DE' %04" PRIX16 "  XY %04" PRIX16 "\n"
+		"WZ %04" PRIX16		   "  HL %04" PRIX16 "  HL' %04" PRIX16 "  Q  %02" PRIX8  "\n"
+		"S Z Y H X P N C"      "  IFF1 %" PRIu8 "  IM %" PRIu8 "  EI %" PRIu8 "\n"
+		"%c %c %c %c %c %c %c %c  IFF2 %" PRIu8 "  R7 %" PRIu8 "  RI %" PRIu8 "\n",
+		Z80_PC(*z80),	  Z80_AF(*z80), Z80_AF_(*z80), Z80_IX(*z80),
+		Z80_SP(*z80),	  Z80_BC(*z80), Z80_BC_(*z80), Z80_IY(*z80),
+		z80->i, z80->r,	  Z80_DE(*z80), Z80_DE_(*z80), Z80_IX(*z80),
+		Z80_MEMPTR(*z80), Z80_HL(*z80), Z80_HL_(*z80), z80->q,
+		z80->iff1, z80->im, '\0',
+		one_hyphen[!(f & Z80_SF)],
+		one_hyphen[!(f & Z80_ZF)],
+		one_hyphen[!(f & Z80_YF)],
+		one_hyphen[!(f & Z80_HF)],
+		one_hyphen[!(f & Z80_XF)],
+		one_hyphen[!(f & Z80_PF)],
+		one_hyphen[!(f & Z80_NF)],
+		one_hyphen[!(f & Z80_CF)],
+		z80->iff2, z80->r7 >> 7, '\0');
+
+	return Qnil;
+	}
+
+
+/* MARK: - Object Lifecycle */
+
+static void Z80__mark(Z80 *z80)
+	{
+	Bindings *bindings = z80->context;
+	VALUE *externals = bindings->external;
+
+	for (int i = 18; i;) if (externals[--i] != Qnil)
+		rb_gc_mark_movable(externals[i]);
+
+	if (bindings->native_handlers != NULL)
+		for (int i = Context; i;) if (bindings->native_handlers[--i].owner != Qnil)
+			rb_gc_mark_movable(bindings->native_handlers[i].owner);
+
+	for (zusize i = bindings->port_handler_count; i;)
+		rb_gc_mark_movable(bindings->port_handlers[--i].owner);
+
+	if (bindings->memory_pages != NULL)
+		for (int i = 256; i;) if (bindings->memory_pages[--i].owner != Qnil)
+			rb_gc_mark_movable(bindings->memory_pages[i].owner);
+	}
+
+
+static void Z80__free(Machine *machine)
+	{
+	OutputLog *log = machine->bindings.output_log;
+	Beeper *beeper = machine->bindings.beeper;
+
+	if (log != NULL)
+		{
+		xfree(log->filters);
+		xfree(log->data);
+		xfree(log);
+		}
+
+	if (beeper != NULL)
+		{
+		xfree(beeper->data);
+		xfree(beeper);
+		}
+
+	if (machine->bindings.machine_template != NULL)
+		{
+		xfree(machine->bindings.machine_template->snapshot);
+		xfree(machine->bindings.machine_template);
+		}
+
+	if (machine->bindings.profiler != NULL)
+		{
+		xfree(machine->bindings.profiler->nodes);
+		xfree(machine->bindings.profiler->frames);
+		xfree(machine->bindings.profiler);
+		}
+
+	xfree(machine->bindings.native_handlers);
+	xfree(machine->bindings.port_handlers);
+	xfree(machine->bindings.memory_pages);
+	xfree(machine);
+	}
+
+
+static size_t Z80__memsize(const void *machine)
+	{
+	Bindings const *bindings = &((Machine const *)machine)->bindings;
+
+	return	sizeof(Machine) +
+		(bindings->native_handlers != NULL ? sizeof(NativeHandler[Context]) : 0) +
+		sizeof(PortHandler) * bindings->port_handler_count +
+		(bindings->memory_pages != NULL ? sizeof(MemoryPage[256]) : 0) +
+		(bindings->output_log != NULL
+			? sizeof(OutputLog) +
+			  sizeof(PortFilter) * bindings->output_log->filter_count +
+			  bindings->output_log->capacity
+			: 0) +
+		(bindings->beeper != NULL ? sizeof(Beeper) + bindings->beeper->capacity : 0) +
+		(bindings->profiler != NULL
+			? sizeof(Profiler) +
+			  sizeof(ProfileNode) * bindings->profiler->node_capacity +
+			  sizeof(ProfileFrame) * bindings->profiler->frame_capacity
+			: 0) +
+		(bindings->machine_template != NULL
+			? sizeof(Template) + bindings->machine_template->page_count * MEMORY_PAGE_SIZE
+			: 0);
+	}
+
+
+static void Z80__compact(Z80 *z80)
+	{
+	Bindings *bindings = z80->context;
+	VALUE *externals = bindings->external;
+
+	for (int i = 18; i;) if (externals[--i] != Qnil)
+		externals[i] = rb_gc_location(externals[i]);
+
+	if (bindings->native_handlers != NULL)
+		for (int i = Context; i;) if (bindings->native_handlers[--i].owner != Qnil)
+			bindings->native_handlers[i].owner = rb_gc_location(bindings->native_handlers[i].owner);
+
+	for (zusize i = bindings->port_handler_count; i;)
+		{
+		PortHandler *handler = bindings->port_handlers + --i;
+		handler->owner = rb_gc_location(handler->owner);
+		}
+
+	if (bindings->memory_pages != NULL)
+		for (int i = 256; i;) if (bindings->memory_pages[--i].owner != Qnil)
+			bindings->memory_pages[i].owner = rb_gc_location(bindings->memory_pages[i].owner);
+	}
+
+
+static rb_data_type_t const z80_data_type = {
+	.wrap_struct_name = "z80",
+	.function = {
+#		if defined(RUBY_API_VERSION_MAJOR) && RUBY_API_VERSION_MAJOR >= 3
+			.dcompact = (void (*)(void *))Z80__compact,
+#		endif
+		.dmark = (void (*)(void *))Z80__mark,
+		.dfree = (void (*)(void *))Z80__free,
+		.dsize = Z80__memsize},
+	.flags = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED};
+
+
+static VALUE Z80__alloc(VALUE klass)
+	{
+	Machine *machine;
+	VALUE object = TypedData_Make_Struct(klass, Machine, &z80_data_type, machine);
+	Z80 *z80 = &machine->z80;
+	Bindings *bindings = z80->context = &machine->bindings;
+
+	for (int i = 18; i;) bindings->external[--i] = Qnil;
+
+	bindings->native_handlers    = NULL;
+	bindings->port_handlers	     = NULL;
+	bindings->port_handler_count = 0;
+	bindings->memory_pages	     = NULL;
+	bindings->mapped_page_count  = 0;
+	bindings->terminated	     = Z_FALSE;
+	memset(&bindings->realtime_stats, 0, sizeof(RealtimeStats));
+	bindings->total_cycles	     = 0;
+	bindings->running	     = Z_FALSE;
+	bindings->output_log	     = NULL;
+	bindings->beeper	     = NULL;
+	bindings->profiler	     = NULL;
+	bindings->machine_template   = NULL;
+
+	z80->options	  = Z80_MODEL_ZILOG_NMOS;
+	z80->fetch_opcode =
+	z80->fetch	  =
+	z80->read	  = dummy_read;
+	z80->write	  =
+	z80->out	  = dummy_write;
+	z80->in		  = dummy_in;
+	z80->halt	  = NULL;
+	z80->nop	  =
+	z80->nmia	  =
+	z80->inta	  =
+	z80->int_fetch	  =
+	z80->hook	  = NULL;
+	z80->ld_i_a	  =
+	z80->ld_r_a	  =
+	z80->reti	  =
+	z80->retn	  = NULL;
+	z80->illegal	  = NULL;
+
+	for (int i = Context; i--;) bindings->callbacks[i] =
+		*(void **)((char *)z80 + callback_info_table[i].offset);
+
+	return object;
+	}
+
+
+/* MARK: - Input Queues */
+
+static rb_data_type_t const input_queue_data_type;
+
+typedef struct {
+	zuint8* data;
+	zusize	capacity;
+	zusize	head;
+	zusize	tail;
+	VALUE	on_empty;
+	zuint8	ready;
+	zuint8	idle;
+	zuint8	empty;
+} InputQueue;
+
+#define GET_INPUT_QUEUE \
+	InputQueue *queue; \
+	TypedData_Get_Struct(self, InputQueue, &input_queue_data_type, queue);
+
+
+static zuint8 input_queue_read(InputQueue *queue, zuint16 port)
+	{
+	zuint8 byte;
+
+	Z_UNUSED(port)
+	if (queue->head == queue->tail) return queue->empty;
+	byte = queue->data[queue->head++];
+
+	if (queue->head == queue->tail)
+		{
+		queue->head = queue->tail = 0;
+
+		if (queue->on_empty != Qnil)
+			rb_funcall(queue->on_empty, rb_intern("call"), 0);
+		}
+
+	return byte;
+	}
+
+
+static zuint8 input_queue_status(InputQueue *queue, zuint16 port)
+	{
+	Z_UNUSED(port)
+	return queue->head != queue->tail ? queue->ready : queue->idle;
+	}
+
+
+static void input_queue_append(InputQueue *queue, void const *data, zusize size)
+	{
+	zusize count = queue->tail - queue->head;
+
+	if (queue->tail + size > queue->capacity)
+		{
+		if (queue->head)
+			{
+			memmove(queue->data, queue->data + queue->head, count);
+			queue->head = 0;
+			queue->tail = count;
+			}
+
+		if (count + size > queue->capacity)
+			{
+			zusize capacity = queue->capacity ? queue->capacity : 256;
+
+			while (capacity < count + size) capacity *= 2;
+			REALLOC_N(queue->data, zuint8, capacity);
+			queue->capacity = capacity;
+			}
+		}
+
+	memcpy(queue->data + queue->tail, data, size);
+	queue->tail += size;
+	}
+
+
+static VALUE InputQueue__initialize(int argc, VALUE *argv, VALUE self)
+	{
+	static ID keywords[3];
+	VALUE options, values[3];
+	GET_INPUT_QUEUE;
+
+	if (!keywords[0])
+		{
+		keywords[0] = rb_intern("ready");
+		keywords[1] = rb_intern("idle");
+		keywords[2] = rb_intern("empty");
+		}
+
+	rb_scan_args(argc, argv, "0:", &options);
+	rb_get_kwargs(options, keywords, 0, 3, values);
+	if (values[0] != Qundef) queue->ready = (zuint8)NUM2UINT(values[0]);
+	if (values[1] != Qundef) queue->idle  = (zuint8)NUM2UINT(values[1]);
+	if (values[2] != Qundef) queue->empty = (zuint8)NUM2UINT(values[2]);
+	return self;
+	}
+
+
+/* IOs are read without blocking, in chunks of `INPUT_CHUNK_SIZE` bytes, until
+ * the end of the file or until no more data is available at the moment. Files
+ * are thus read entirely, whereas a pipe, socket or terminal can be pushed
+ * periodically. Other objects that respond to `read` are read entirely. */
+
+#define INPUT_CHUNK_SIZE 65536
+
+
+static VALUE InputQueue__push(int argc, VALUE *argv, VALUE self)
+	{
+	GET_INPUT_QUEUE;
+
+	for (int i = 0; i < argc; i++)
+		{
+		VALUE data = argv[i];
+
+		if (!RB_TYPE_P(data, T_STRING))
+			{
+			if (rb_respond_to(data, rb_intern("read_nonblock")))
+				{
+				VALUE io = data, arguments[2];
+
+				arguments[0] = INT2FIX(INPUT_CHUNK_SIZE);
+				arguments[1] = rb_hash_new();
+				rb_hash_aset(arguments[1], ID2SYM(rb_intern("exception")), Qfalse);
+
+				/* Until nil (end of file) or :wait_readable. */
+				while (RB_TYPE_P(
+					data = rb_funcallv_kw(
+						io, rb_intern("read_nonblock"),
+						2, arguments, RB_PASS_KEYWORDS),
+					T_STRING)
+				)
+					input_queue_append(queue, RSTRING_PTR(data), RSTRING_LEN(data));
+
+				continue;
+				}
+
+			else if (	rb_respond_to(data, rb_intern("read")) &&
+					(data = rb_funcall(data, rb_intern("read"), 0)) == Qnil
+			)
+				continue;
+			}
+
+		StringValue(data);
+		input_queue_append(queue, RSTRING_PTR(data), RSTRING_LEN(data));
+		}
+
+	return self;
+	}
+
+
+static VALUE InputQueue__append(VALUE self, VALUE data)
+	{return InputQueue__push(1, &data, self);}
+
+
+static VALUE InputQueue__size(VALUE self)
+	{
+	GET_INPUT_QUEUE;
+	return SIZET2NUM(queue->tail - queue->head);
+	}
+
+
+static VALUE InputQueue__empty_p(VALUE self)
+	{
+	GET_INPUT_QUEUE;
+	return queue->head == queue->tail ? Qtrue : Qfalse;
+	}
+
+
+static VALUE InputQueue__clear(VALUE self)
+	{
+	GET_INPUT_QUEUE;
+	queue->head = queue->tail = 0;
+	return self;
+	}
+
+
+static VALUE InputQueue__set_on_empty(VALUE self, VALUE callback)
+	{
+	GET_INPUT_QUEUE;
+	RB_OBJ_WRITE(self, &queue->on_empty, callback);
+	return Qnil;
+	}
+
+
+static VALUE InputQueue__on_empty(VALUE self)
+	{
+	GET_INPUT_QUEUE;
+	if (rb_block_given_p()) RB_OBJ_WRITE(self, &queue->on_empty, rb_block_proc());
+	return queue->on_empty;
+	}
+
+
+static void InputQueue__mark(InputQueue *queue)
+	{if (queue->on_empty != Qnil) rb_gc_mark_movable(queue->on_empty);}
+
+
+static void InputQueue__free(InputQueue *queue)
+	{
+	xfree(queue->data);
+	xfree(queue);
+	}
+
+
+static size_t InputQueue__memsize(const void *queue)
+	{return sizeof(InputQueue) + ((InputQueue const *)queue)->capacity;}
+
+
+static void InputQueue__compact(InputQueue *queue)
+	{if (queue->on_empty != Qnil) queue->on_empty = rb_gc_location(queue->on_empty);}
+
+
+static rb_data_type_t const input_queue_data_type = {
+	.wrap_struct_name = "z80_input_queue",
+	.function = {
+#		if defined(RUBY_API_VERSION_MAJOR) && RUBY_API_VERSION_MAJOR >= 3
+			.dcompact = (void (*)(void *))InputQueue__compact,
+#		endif
+		.dmark = (void (*)(void *))InputQueue__mark,
+		.dfree = (void (*)(void *))InputQueue__free,
+		.dsize = InputQueue__memsize},
+	.flags = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED};
+
+
+static VALUE InputQueue__alloc(VALUE klass)
+	{
+	InputQueue *queue;
+	VALUE object = TypedData_Make_Struct(klass, InputQueue, &input_queue_data_type, queue);
+
+	queue->data	= NULL;
+	queue->capacity = queue->head = queue->tail = 0;
+	queue->on_empty = Qnil;
+	queue->ready	= 1;
+	queue->idle	= 0;
+	queue->empty	= 255;
+	return object;
+	}
+
+
+/* The first matching port handler wins, so a queue attached to a port that is
+ * already read by another handler would never be read. */
+
+static void check_input_port(VALUE self, zuint16 port, zuint16 mask)
+	{
+	Bindings const *bindings;
+	PortHandler const *handler, *end;
+	GET_Z80;
+
+	bindings = z80->context;
+	handler = bindings->port_handlers;
+	end = handler + bindings->port_handler_count;
+
+	for (; handler != end; handler++) if (
+		handler->in != NULL &&
+		!((port ^ handler->port) & mask & handler->mask)
+	)
+		rb_raise(rb_eArgError, "port 0x%04X is already used by another input handler", port);
+	}
+
+
+static VALUE Z80__attach_input(int argc, VALUE *argv, VALUE self)
+	{
+	InputQueue *queue;
+	VALUE object, data_port, status_port, mask;
+	zuint16 port_mask;
+
+	rb_scan_args(argc, argv, "22", &object, &data_port, &status_port, &mask);
+	TypedData_Get_Struct(object, InputQueue, &input_queue_data_type, queue);
+	port_mask = mask == Qnil ? 0xFF : (zuint16)NUM2UINT(mask);
+	check_input_port(self, (zuint16)NUM2UINT(data_port), port_mask);
+
+	if (status_port != Qnil)
+		{
+		check_input_port(self, (zuint16)NUM2UINT(status_port), port_mask);
+
+		if (!((NUM2UINT(data_port) ^ NUM2UINT(status_port)) & port_mask))
+			rb_raise(rb_eArgError, "the data and status ports must be different");
+		}
+
+	add_port_handler(
+		self, (zuint16)NUM2UINT(data_port), port_mask,
+		(Z80Read)input_queue_read, NULL, queue, object);
+
+	if (status_port != Qnil) add_port_handler(
+		self, (zuint16)NUM2UINT(status_port), port_mask,
+		(Z80Read)input_queue_status, NULL, queue, object);
+
+	return self;
+	}
+
+
+static VALUE Z80__detach_input(VALUE self, VALUE queue)
+	{
+	GET_Z80;
+	remove_port_handlers(z80, queue);
+	return self;
+	}
+
+
+/* MARK: - Output Log and Beeper */
+
+static VALUE Z80__watch_out(int argc, VALUE *argv, VALUE self)
+	{
+	Bindings *bindings;
+	OutputLog *log;
+	PortFilter *filter;
+	VALUE port, mask;
+	GET_Z80;
+
+	rb_scan_args(argc, argv, "11", &port, &mask);
+	bindings = z80->context;
+
+	if ((log = bindings->output_log) == NULL)
+		log = bindings->output_log = ZALLOC(OutputLog);
+
+	REALLOC_N(log->filters, PortFilter, log->filter_count + 1);
+	filter = log->filters + log->filter_count++;
+	filter->mask = mask == Qnil ? 0xFF : (zuint16)NUM2UINT(mask);
+	filter->port = (zuint16)NUM2UINT(port) & filter->mask;
+	update_port_bridges(z80);
+	return self;
+	}
+
+
+static VALUE Z80__unwatch_out(VALUE self)
+	{
+	Bindings *bindings;
+	GET_Z80;
+
+	bindings = z80->context;
+
+	if (bindings->output_log != NULL)
+		{
+		xfree(bindings->output_log->filters);
+		xfree(bindings->output_log->data);
+		xfree(bindings->output_log);
+		bindings->output_log = NULL;
+		update_port_bridges(z80);
+		}
+
+	return self;
+	}
+
+
+static VALUE Z80__drain_out_log(VALUE self)
+	{
+	OutputLog *log;
+	VALUE events;
+	GET_Z80;
+
+	if ((log = ((Bindings *)z80->context)->output_log) == NULL)
+		return rb_str_new(NULL, 0);
+
+	events = rb_str_new((char const *)log->data, (long)log->size);
+	log->size = 0;
+	return events;
+	}
+
+
+static VALUE Z80__attach_beeper(int argc, VALUE *argv, VALUE self)
+	{
+	static ID keywords[6];
+	VALUE port, bit, options, values[6];
+	Bindings *bindings;
+	Beeper *beeper;
+	zuint64 clock_hz, sample_rate;
+	zuint amplitude = 8192;
+	zuint16 mask = 0xFF;
+	zuint bit_index;
+	GET_Z80;
+
+	if (!keywords[0])
+		{
+		keywords[0] = rb_intern("clock_hz");
+		keywords[1] = rb_intern("sample_rate");
+		keywords[2] = rb_intern("mask");
+		keywords[3] = rb_intern("amplitude");
+		keywords[4] = rb_intern("level");
+		keywords[5] = rb_intern("centered");
+		}
+
+	rb_scan_args(argc, argv, "2:", &port, &bit, &options);
+	rb_get_kwargs(options, keywords, 2, 4, values);
+
+	if (!(clock_hz = NUM2ULL(values[0])))
+		rb_raise(rb_eArgError, "clock_hz must be greater than 0");
+
+	if (!(sample_rate = NUM2ULL(values[1])))
+		rb_raise(rb_eArgError, "sample_rate must be greater than 0");
+
+	if ((bit_index = NUM2UINT(bit)) > 7)
+		rb_raise(rb_eArgError, "bit out of range (expected 0..7)");
+
+	if (values[2] != Qundef) mask = (zuint16)NUM2UINT(values[2]);
+
+	if (values[3] != Qundef && (amplitude = NUM2UINT(values[3])) > 32767)
+		rb_raise(rb_eArgError, "amplitude out of range (expected 0..32767)");
+
+	bindings = z80->context;
+
+	if ((beeper = bindings->beeper) == NULL)
+		beeper = bindings->beeper = ZALLOC(Beeper);
+
+	beeper->port	    = (zuint16)NUM2UINT(port) & mask;
+	beeper->mask	    = mask;
+	beeper->bit	    = (zuint8)(1U << bit_index);
+	/* Until the first write to the port, the bit is assumed to be at `level`.
+	 * A mismatch with the machine produces a step (a click) at that write. */
+	beeper->level	    = values[4] != Qundef && RTEST(values[4]);
+	beeper->centered    = values[5] != Qundef && RTEST(values[5]);
+	beeper->amplitude   = (zuint16)amplitude;
+	beeper->clock_hz    = clock_hz;
+	beeper->sample_rate = sample_rate;
+	beeper->position    = current_cycle(bindings);
+	beeper->phase	    = 0;
+	beeper->high	    = 0;
+	beeper->size	    = 0;
+	update_port_bridges(z80);
+	return self;
+	}
+
+
+static VALUE Z80__detach_beeper(VALUE self)
+	{
+	Bindings *bindings;
+	GET_Z80;
+
+	bindings = z80->context;
+
+	if (bindings->beeper != NULL)
+		{
+		xfree(bindings->beeper->data);
+		xfree(bindings->beeper);
+		bindings->beeper = NULL;
+		update_port_bridges(z80);
+		}
+
+	return self;
+	}
+
+
+static VALUE Z80__render_beeper(VALUE self)
+	{
+	Beeper *beeper;
+	VALUE samples;
+	GET_Z80;
+
+	if ((beeper = ((Bindings *)z80->context)->beeper) == NULL)
+		rb_raise(rb_eRuntimeError, "no beeper attached");
+
+	beeper_advance(beeper, current_cycle(z80->context));
+	samples = rb_str_new((char const *)beeper->data, (long)beeper->size);
+	beeper->size = 0;
+	return samples;
+	}
+
+
+/* MARK: - Profiling */
+
+static VALUE Z80__start_profiling(VALUE self)
+	{
+	Bindings *bindings;
+	Profiler *profiler;
+	GET_Z80;
+
+	bindings = z80->context;
+
+	if ((profiler = bindings->profiler) == NULL)
+		{
+		profiler = bindings->profiler = ZALLOC(Profiler);
+		profiler->nodes = ALLOC_N(ProfileNode, profiler->node_capacity = 64);
+		profiler->frames = ALLOC_N(ProfileFrame, profiler->frame_capacity = 64);
+		}
+
+	profiler->node_count = 1;
+	profiler->frame_count = 0;
+	memset(profiler->nodes, 0, sizeof(ProfileNode));
+	profiler->last_cycle = current_cycle(bindings);
+	profiler->last_iff1  = z80->iff1;
+	profiler->disabling  = Z_FALSE;
+	profiler->pending    = ProfileNothing;
+	profiler->prefix     = 0;
+	profiler->active     = Z_TRUE;
+	update_memory_bridges(z80);
+	update_return_bridges(z80);
+	return self;
+	}
+
+
+static VALUE Z80__stop_profiling(VALUE self)
+	{
+	Profiler *profiler;
+	GET_Z80;
+
+	if ((profiler = ((Bindings *)z80->context)->profiler) != NULL && profiler->active)
+		{
+		profiler_charge(profiler, current_cycle(z80->context));
+		profiler->active = Z_FALSE;
+		update_memory_bridges(z80);
+		update_return_bridges(z80);
+		}
+
+	return self;
+	}
+
+
+static VALUE Z80__profiling_p(VALUE self)
+	{
+	Profiler const *profiler;
+	GET_Z80;
+
+	profiler = ((Bindings *)z80->context)->profiler;
+	return profiler != NULL && profiler->active ? Qtrue : Qfalse;
+	}
+
+
+static Profiler *current_profile(Z80 *z80)
+	{
+	Profiler *profiler = ((Bindings *)z80->context)->profiler;
+
+	if (profiler != NULL && profiler->active)
+		profiler_charge(profiler, current_cycle(z80->context));
+
+	return profiler;
+	}
+
+
+/* Returns a Hash with the number of calls and the inclusive and exclusive
+ * cycles of each call target. Recursive calls are counted once towards the
+ * inclusive cycles of their target. */
+
+static VALUE Z80__profile(VALUE self)
+	{
+	Profiler *profiler;
+	VALUE hash, calls, inclusive, exclusive;
+	zuint32 i;
+	GET_Z80;
+
+	hash = rb_hash_new();
+	if ((profiler = current_profile(z80)) == NULL) return hash;
+
+	/* Children are always created after their parents. */
+	for (i = profiler->node_count; i--;) profiler->nodes[i].inclusive = profiler->nodes[i].cycles;
+
+	for (i = profiler->node_count; --i;)
+		profiler->nodes[profiler->nodes[i].parent].inclusive += profiler->nodes[i].inclusive;
+
+	calls	  = ID2SYM(rb_intern("calls"));
+	inclusive = ID2SYM(rb_intern("inclusive"));
+	exclusive = ID2SYM(rb_intern("exclusive"));
+
+	for (i = 1; i < profiler->node_count; i++)
+		{
+		ProfileNode const *node = profiler->nodes + i;
+		VALUE key = UINT2NUM(node->target);
+		VALUE entry = rb_hash_lookup2(hash, key, Qnil);
+		zuint32 ancestor = node->parent;
+
+		if (entry == Qnil)
+			{
+			entry = rb_hash_new();
+			rb_hash_aset(entry, calls, INT2FIX(0));
+			rb_hash_aset(entry, inclusive, INT2FIX(0));
+			rb_hash_aset(entry, exclusive, INT2FIX(0));
+			rb_hash_aset(hash, key, entry);
+			}
+
+		rb_hash_aset(entry, calls, rb_funcall(
+			rb_hash_aref(entry, calls), '+', 1, ULL2NUM(node->calls)));
+
+		rb_hash_aset(entry, exclusive, rb_funcall(
+			rb_hash_aref(entry, exclusive), '+', 1, ULL2NUM(node->cycles)));
+
+		while (ancestor && profiler->nodes[ancestor].target != node->target)
+			ancestor = profiler->nodes[ancestor].parent;
+
+		if (!ancestor) rb_hash_aset(entry, inclusive, rb_funcall(
+			rb_hash_aref(entry, inclusive), '+', 1, ULL2NUM(node->inclusive)));
+		}
+
+	return hash;
+	}
+
+
+/* Returns the exclusive cycles of each call path in the "collapsed stack"
+ * format of the flame graph tools. Call targets are named after
+ * `symbols[address]` (a Hash or any object that responds to `[]`) or in
+ * hexadecimal otherwise. */
+
+static VALUE Z80__profile_collapsed(int argc, VALUE *argv, VALUE self)
+	{
+	Profiler *profiler;
+	VALUE symbols, paths, output;
+	zuint32 i;
+	GET_Z80;
+
+	rb_scan_args(argc, argv, "01", &symbols);
+	output = rb_str_new(NULL, 0);
+	if ((profiler = current_profile(z80)) == NULL) return output;
+	paths = rb_ary_new_capa(profiler->node_count);
+	rb_ary_push(paths, rb_str_new_cstr("root"));
+
+	for (i = 0; i < profiler->node_count; i++)
+		{
+		ProfileNode const *node = profiler->nodes + i;
+		VALUE path;
+
+		if (i)	{
+			VALUE name = symbols != Qnil
+				? rb_funcall(symbols, rb_intern("[]"), 1, UINT2NUM(node->target))
+				: Qnil;
+
+			path = rb_str_dup(rb_ary_entry(paths, node->parent));
+			rb_str_cat_cstr(path, ";");
+
+			if (name != Qnil) rb_str_append(path, rb_obj_as_string(name));
+			else rb_str_catf(path, "%04X", node->target);
+
+			rb_ary_push(paths, path);
+			}
+
+		else path = rb_ary_entry(paths, 0);
+
+		if (node->cycles)
+			{
+			rb_str_append(output, path);
+			rb_str_catf(output, " %" PRIu64 "\n", node->cycles);
+			}
+		}
+
+	return output;
+	}
+
+
+/* MARK: - Memory */
+
+static rb_data_type_t const memory_data_type;
+
+typedef struct {
+	zuint8* data;
+	zusize	size;
+} Memory;
+
+#define GET_MEMORY \
+	Memory *memory; \
+	TypedData_Get_Struct(self, Memory, &memory_data_type, memory);
+
+
+static void check_memory_range(Memory const *memory, zusize address, zusize size)
+	{
+	if (address > memory->size || size > memory->size - address) rb_raise(
+		rb_eIndexError,
+		"range %" PRIuMAX "...%" PRIuMAX " out of memory bounds (size %" PRIuMAX ")",
+		(uintmax_t)address, (uintmax_t)address + size, (uintmax_t)memory->size);
+	}
+
+
+static VALUE Memory__initialize(int argc, VALUE *argv, VALUE self)
+	{
+	VALUE size;
+	GET_MEMORY;
+
+	rb_scan_args(argc, argv, "01", &size);
+
+	/* The data may be mapped into CPUs, so it cannot be reallocated. */
+	if (memory->data != NULL)
+		rb_raise(rb_eRuntimeError, "memory already initialized");
+
+	memory->size = size == Qnil ? 65536 : NUM2SIZET(size);
+	memory->data = ZALLOC_N(zuint8, memory->size);
+	return self;
+	}
+
+
+static VALUE Memory__size(VALUE self)
+	{
+	GET_MEMORY;
+	return SIZET2NUM(memory->size);
+	}
+
+
+static VALUE Memory__get(VALUE self, VALUE address)
+	{
+	zusize index = NUM2SIZET(address);
+	GET_MEMORY;
+
+	check_memory_range(memory, index, 1);
+	return UINT2NUM(memory->data[index]);
+	}
+
+
+static VALUE Memory__set(VALUE self, VALUE address, VALUE value)
+	{
+	zusize index = NUM2SIZET(address);
+	GET_MEMORY;
+
+	check_memory_range(memory, index, 1);
+	memory->data[index] = (zuint8)NUM2UINT(value);
+	return value;
+	}
+
+
+static VALUE Memory__read(VALUE self, VALUE address, VALUE size)
+	{
+	zusize index = NUM2SIZET(address), count = NUM2SIZET(size);
+	GET_MEMORY;
+
+	check_memory_range(memory, index, count);
+	return rb_str_new((char const *)memory->data + index, count);
+	}
+
+
+static VALUE Memory__write(VALUE self, VALUE address, VALUE data)
+	{
+	zusize index = NUM2SIZET(address);
+	GET_MEMORY;
+
+	StringValue(data);
+	check_memory_range(memory, index, RSTRING_LEN(data));
+	memcpy(memory->data + index, RSTRING_PTR(data), RSTRING_LEN(data));
+	return self;
+	}
+
+
+static void Memory__free(Memory *memory)
+	{
+	xfree(memory->data);
+	xfree(memory);
+	}
+
+
+static size_t Memory__memsize(const void *memory)
+	{return sizeof(Memory) + ((Memory const *)memory)->size;}
+
+
+static rb_data_type_t const memory_data_type = {
+	.wrap_struct_name = "z80_memory",
+	.function = {
+		.dmark = NULL,
+		.dfree = (void (*)(void *))Memory__free,
+		.dsize = Memory__memsize},
+	.flags = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED};
+
+
+static VALUE Memory__alloc(VALUE klass)
+	{
+	Memory *memory;
+	VALUE object = TypedData_Make_Struct(klass, Memory, &memory_data_type, memory);
+
+	memory->data = NULL;
+	memory->size = 0;
+	return object;
+	}
+
+
+static void check_page_range(zusize address, zusize size)
+	{
+	if ((address | size) % MEMORY_PAGE_SIZE || address + size > 65536) rb_raise(
+		rb_eArgError,
+		"the address and size must be multiples of %d within the 64 KiB address space",
+		MEMORY_PAGE_SIZE);
+	}
+
+
+/* Returns the page at the given index after unmapping it, allocating the page
+ * table if needed. The caller sets the page's data or handler. */
+
+static MemoryPage *map_page(VALUE self, zusize index, VALUE owner)
+	{
+	Bindings *bindings;
+	MemoryPage *page;
+	GET_Z80;
+
+	bindings = z80->context;
+
+	if (bindings->memory_pages == NULL)
+		{
+		bindings->memory_pages = ALLOC_N(MemoryPage, 256);
+
+		for (int i = 256; i;)
+			{
+			page = bindings->memory_pages + --i;
+			page->read   = page->write  = NULL;
+			page->reader = NULL;
+			page->writer = NULL;
+			page->context = NULL;
+			page->owner  = Qnil;
+			}
+		}
+
+	page = bindings->memory_pages + index;
+	if (page->read == NULL && page->reader == NULL) bindings->mapped_page_count++;
+	page->read   = page->write  = NULL;
+	page->reader = NULL;
+	page->writer = NULL;
+	page->context = NULL;
+	RB_OBJ_WRITE(self, &page->owner, owner);
+	return page;
+	}
+
+
+static void unmap_page(Bindings *bindings, zusize index)
+	{
+	MemoryPage *page = bindings->memory_pages + index;
+
+	if (page->read != NULL || page->reader != NULL) bindings->mapped_page_count--;
+	page->read   = page->write  = NULL;
+	page->reader = NULL;
+	page->writer = NULL;
+	page->context = NULL;
+	page->owner  = Qnil;
+	}
+
+
+static void release_memory_pages(Bindings *bindings)
+	{
+	if (bindings->memory_pages != NULL && !bindings->mapped_page_count)
+		{
+		xfree(bindings->memory_pages);
+		bindings->memory_pages = NULL;
+		}
+	}
+
+
+static VALUE Z80__map(int argc, VALUE *argv, VALUE self)
+	{
+	Memory *memory;
+	VALUE address, object, offset, size, read_only;
+	zusize first, data_offset, page_count;
+	GET_Z80;
+
+	rb_scan_args(argc, argv, "23", &address, &object, &offset, &size, &read_only);
+	TypedData_Get_Struct(object, Memory, &memory_data_type, memory);
+	first	    = NUM2SIZET(address);
+	data_offset = offset == Qnil ? 0 : NUM2SIZET(offset);
+	check_memory_range(memory, data_offset, 0);
+
+	page_count = size == Qnil
+		? memory->size - data_offset
+		: NUM2SIZET(size);
+
+	if (size == Qnil && page_count > 65536 - first) page_count = 65536 - first;
+	check_page_range(first, page_count);
+	check_memory_range(memory, data_offset, page_count);
+
+	first /= MEMORY_PAGE_SIZE;
+	page_count /= MEMORY_PAGE_SIZE;
+
+	for (zusize i = 0; i < page_count; i++)
+		{
+		MemoryPage *page = map_page(self, first + i, object);
+		zuint8 *data = memory->data + data_offset + i * MEMORY_PAGE_SIZE;
+
+		page->read  = data;
+		page->write = RB_TEST(read_only) ? NULL : data;
+		}
+
+	update_memory_bridges(z80);
+	return self;
+	}
+
+
+static VALUE Z80__unmap(int argc, VALUE *argv, VALUE self)
+	{
+	Bindings *bindings;
+	VALUE address, size;
+	zusize first, page_count;
+	GET_Z80;
+
+	rb_scan_args(argc, argv, "11", &address, &size);
+	first = NUM2SIZET(address);
+	page_count = size == Qnil ? 65536 - first : NUM2SIZET(size);
+	check_page_range(first, page_count);
+	bindings = z80->context;
+	if (bindings->memory_pages == NULL) return self;
+	first /= MEMORY_PAGE_SIZE;
+	page_count /= MEMORY_PAGE_SIZE;
+
+	for (zusize i = 0; i < page_count; i++) unmap_page(bindings, first + i);
+
+	release_memory_pages(bindings);
+	update_memory_bridges(z80);
+	return self;
+	}
+
+
+/* MARK: - Templates */
+
+/* A template is a copy of the CPU state and of the pages of native memory
+ * mapped read-write when it was captured. While it exists, the pages written
+ * by the CPU are tracked so that `Z80#reset_to_template` only has to restore
+ * those. Writes performed by other means (`Z80::Memory#write`, other CPUs
+ * sharing the memory) are not tracked.
+ *
+ * `Z80#total_cycles` is not restored: the output log, the beeper and the
+ * profiler depend on it never going backwards. */
+
+static VALUE Z80__capture_template(VALUE self)
+	{
+	Bindings *bindings;
+	Template *machine_template;
+	zuint page_count = 0;
+	zuint8 *snapshot;
+	int i;
+	GET_Z80;
+
+	bindings = z80->context;
+
+	if (bindings->memory_pages != NULL) for (i = 256; i;)
+		if (bindings->memory_pages[--i].write != NULL) page_count++;
+
+	snapshot = page_count ? ALLOC_N(zuint8, page_count * MEMORY_PAGE_SIZE) : NULL;
+
+	if ((machine_template = bindings->machine_template) == NULL)
+		machine_template = bindings->machine_template = ALLOC(Template);
+
+	else xfree(machine_template->snapshot);
+
+	machine_template->state	       = *z80;
+	machine_template->snapshot     = snapshot;
+	machine_template->page_count   = page_count;
+	machine_template->dirty_count  = 0;
+	memset(machine_template->dirty, 0, sizeof(machine_template->dirty));
+
+	for (i = 0; i < 256; i++)
+		{
+		zuint8 *data = bindings->memory_pages != NULL
+			? bindings->memory_pages[i].write
+			: NULL;
+
+		if ((machine_template->targets[i] = data) != NULL)
+			{
+			memcpy(snapshot, data, MEMORY_PAGE_SIZE);
+			machine_template->pages[i] = snapshot;
+			snapshot += MEMORY_PAGE_SIZE;
+			}
+
+		else machine_template->pages[i] = NULL;
+		}
+
+	update_memory_bridges(z80);
+	return self;
+	}
+
+
+static VALUE Z80__reset_to_template(VALUE self)
+	{
+	Bindings *bindings;
+	Template *machine_template;
+	Profiler *profiler;
+	zuint i;
+	GET_Z80;
+
+	bindings = z80->context;
+
+	if ((machine_template = bindings->machine_template) == NULL)
+		rb_raise(rb_eRuntimeError, "no template captured");
+
+	for (i = 0; i < machine_template->dirty_count; i++)
+		{
+		zuint8 index = machine_template->dirty_pages[i];
+		zuint8 *data;
+
+		machine_template->dirty[index] = 0;
+
+		/* The page table is released when everything is unmapped, and
+		 * the page may have been remapped since the template was
+		 * captured. */
+		if (	bindings->memory_pages != NULL &&
+			(data = bindings->memory_pages[index].write) != NULL &&
+			data == machine_template->targets[index]
+		)
+			memcpy(data, machine_template->pages[index], MEMORY_PAGE_SIZE);
+		}
+
+	machine_template->dirty_count = 0;
+	profiler = current_profile(z80);
+
+	/* Within a run, the clock stays where it was despite the change of
+	 * `cycles`. */
+	if (bindings->running) bindings->total_cycles =
+		bindings->total_cycles + z80->cycles - machine_template->state.cycles;
+
+	for (i = 0; i < Z_ARRAY_SIZE(uint16_members); i++)
+		*(zuint16 *)(void *)((char *)z80 + uint16_members[i].offset) =
+		*(zuint16 *)(void *)((char *)&machine_template->state + uint16_members[i].offset);
+
+	for (i = 0; i < Z_ARRAY_SIZE(uint8_members); i++)
+		*((zuint8 *)z80 + uint8_members[i].offset) =
+		*((zuint8 *)&machine_template->state + uint8_members[i].offset);
+
+	z80->data   = machine_template->state.data;
+	z80->cycles = machine_template->state.cycles;
+
+	/* The call stack of the restored state is unknown. */
+	if (profiler != NULL && profiler->active)
+		{
+		profiler->last_cycle  = current_cycle(bindings);
+		profiler->frame_count = 0;
+		profiler->pending     = ProfileNothing;
+		profiler->prefix      = 0;
+		profiler->last_iff1   = z80->iff1;
+		profiler->disabling   = Z_FALSE;
+		}
+
+	return self;
+	}
+
+
+static VALUE Z80__dirty_pages(VALUE self)
+	{
+	Template const *machine_template;
+	VALUE pages;
+	zuint i;
+	GET_Z80;
+
+	pages = rb_ary_new();
+
+	if ((machine_template = ((Bindings *)z80->context)->machine_template) != NULL)
+		for (i = 0; i < machine_template->dirty_count; i++)
+			rb_ary_push(pages, UINT2NUM(machine_template->dirty_pages[i] * MEMORY_PAGE_SIZE));
+
+	return pages;
+	}
+
+
+/* MARK: - Systems */
+
+/* A system interleaves several CPUs in slices of `quantum` ticks. Each CPU
+ * runs `multiplier / divisor` clock cycles per tick; the remainder of the
+ * division and the cycles overrun at the end of a slice are carried over to
+ * the next one, so the CPUs never drift apart by more than one slice. */
+
+static rb_data_type_t const system_data_type;
+
+typedef struct {
+	VALUE  object;
+	Z80*   z80;
+	zusize multiplier;
+	zusize divisor;
+	zusize remainder;
+	zusize overrun;
+} SystemCPU;
+
+typedef struct {
+	VALUE  target;
+	Z80*   z80;
+	zuint8 value;
+	zuint8 interrupt;
+} Link;
+
+enum {NoInterrupt, INTInterrupt, NMIInterrupt};
+
+typedef struct {
+	SystemCPU* cpus;
+	zusize	   cpu_count;
+	Link**	   links;
+	zusize	   link_count;
+	zusize	   quantum;
+	SystemCPU* current;
+	zbool	   terminated;
+} System;
+
+#define GET_SYSTEM \
+	System *system; \
+	TypedData_Get_Struct(self, System, &system_data_type, system);
+
+
+static zuint8 link_read(Link *link, zuint16 port)
 	{
-	GET_Z80;
-	return UINT2NUM(z80_r(z80));
+	Z_UNUSED(port)
+	if (link->interrupt == INTInterrupt) z80_int(link->z80, Z_FALSE);
+	return link->value;
 	}
 
 
-static VALUE Z80__refresh_address(VALUE self)
+static void link_write(Link *link, zuint16 port, zuint8 value)
 	{
-	GET_Z80;
-	return UINT2NUM(z80_refresh_address(z80));
+	Z_UNUSED(port)
+	link->value = value;
+
+	if (link->interrupt == INTInterrupt) z80_int(link->z80, Z_TRUE);
+	else if (link->interrupt == NMIInterrupt) z80_nmi(link->z80);
 	}
 
 
-static VALUE Z80__in_cycle(VALUE self)
+static void interrupt_line_write(Link *link, zuint16 port, zuint8 value)
 	{
-	GET_Z80;
-	return UINT2NUM(z80_in_cycle(z80));
+	Z_UNUSED(port)
+
+	if (link->interrupt == INTInterrupt) z80_int(link->z80, value != 0);
+	else if (value) z80_nmi(link->z80);
 	}
 
 
-static VALUE Z80__out_cycle(VALUE self)
+static zuint8 interrupt_type(VALUE type)
 	{
-	GET_Z80;
-	return UINT2NUM(z80_out_cycle(z80));
+	if (type == Qnil) return NoInterrupt;
+	if (type == ID2SYM(rb_intern("int"))) return INTInterrupt;
+	if (type == ID2SYM(rb_intern("nmi"))) return NMIInterrupt;
+	rb_raise(rb_eArgError, "invalid interrupt type (expected :int, :nmi or nil)");
 	}
 
 
-static struct {char const* name; zuint offset;} const
+static Link *system_add_link(VALUE self, VALUE target, zuint8 interrupt)
+	{
+	Link *link;
+	Z80 *z80;
+	GET_SYSTEM;
+
+	/* The link is only added to the list once it is complete, as any of the
+	 * allocations can trigger a GC that marks the list. */
+	TypedData_Get_Struct(target, Z80, &z80_data_type, z80);
+	REALLOC_N(system->links, Link *, system->link_count + 1);
+	link = ALLOC(Link);
+	link->target	= Qnil;
+	link->z80	= z80;
+	link->value	= 0;
+	link->interrupt = interrupt;
+	system->links[system->link_count++] = link;
+	RB_OBJ_WRITE(self, &link->target, target);
+	return link;
+	}
 
-uint16_members[] = {
-	{"memptr", Z_MEMBER_OFFSET(Z80, memptr	)},
-	{"pc",	   Z_MEMBER_OFFSET(Z80, pc	)},
-	{"sp",	   Z_MEMBER_OFFSET(Z80, sp	)},
-	{"xy",	   Z_MEMBER_OFFSET(Z80, xy	)},
-	{"ix",	   Z_MEMBER_OFFSET(Z80, ix_iy[0])},
-	{"iy",	   Z_MEMBER_OFFSET(Z80, ix_iy[1])},
-	{"af",	   Z_MEMBER_OFFSET(Z80, af	)},
-	{"bc",	   Z_MEMBER_OFFSET(Z80, bc	)},
-	{"de",	   Z_MEMBER_OFFSET(Z80, de	)},
-	{"hl",	   Z_MEMBER_OFFSET(Z80, hl	)},
-	{"af_",	   Z_MEMBER_OFFSET(Z80, af_	)},
-	{"bc_",	   Z_MEMBER_OFFSET(Z80, bc_	)},
-	{"de_",	   Z_MEMBER_OFFSET(Z80, de_	)},
-	{"hl_",	   Z_MEMBER_OFFSET(Z80, hl_	)}},
 
-uint8_members[] = {
-	{"i",	      Z_MEMBER_OFFSET(Z80, i	    )},
-	{"r",	      Z_MEMBER_OFFSET(Z80, r	    )},
-	{"r7",	      Z_MEMBER_OFFSET(Z80, r7	    )},
-	{"q",	      Z_MEMBER_OFFSET(Z80, q	    )},
-	{"im",	      Z_MEMBER_OFFSET(Z80, im	    )},
-	{"request",   Z_MEMBER_OFFSET(Z80, request  )},
-	{"resume",    Z_MEMBER_OFFSET(Z80, resume   )},
-	{"options",   Z_MEMBER_OFFSET(Z80, options  )},
-	{"iff1",      Z_MEMBER_OFFSET(Z80, iff1	    )},
-	{"iff2",      Z_MEMBER_OFFSET(Z80, iff2	    )},
-	{"int_line",  Z_MEMBER_OFFSET(Z80, int_line )},
-	{"halt_line", Z_MEMBER_OFFSET(Z80, halt_line)}};
+static VALUE System__initialize(int argc, VALUE *argv, VALUE self)
+	{
+	VALUE quantum;
+	GET_SYSTEM;
+
+	rb_scan_args(argc, argv, "01", &quantum);
+	if (quantum != Qnil && !(system->quantum = NUM2SIZET(quantum))) system->quantum = 1;
+	return self;
+	}
 
 
-static VALUE Z80__to_h(int argc, VALUE *argv, VALUE self)
+static VALUE System__quantum(VALUE self)
 	{
-	Z80 *z80;
-	VALUE hash;
-	VALUE kv[(Z_ARRAY_SIZE(uint16_members) + Z_ARRAY_SIZE(uint8_members)) * 2];
-	int i, j, uint8_member_count;
+	GET_SYSTEM;
+	return SIZET2NUM(system->quantum);
+	}
 
-	if (argc > 1) rb_raise(
-		rb_eArgError,
-		"wrong number of arguments (given %d, expected 0 or 1)",
-		argc);
 
-	TypedData_Get_Struct(self, Z80, &z80_data_type, z80);
-	hash = rb_hash_new();
+static VALUE System__set_quantum(VALUE self, VALUE quantum)
+	{
+	GET_SYSTEM;
+	if (!(system->quantum = NUM2SIZET(quantum))) system->quantum = 1;
+	return quantum;
+	}
 
-	uint8_member_count =
-		Z_ARRAY_SIZE(uint8_members) -
-		((argc && RB_TEST(argv[0])) << 2); /* 4 or 0 */
 
-	for (i = j = 0; j < Z_ARRAY_SIZE(uint16_members);)
-		{
-		kv[i++] = rb_id2sym(rb_intern(uint16_members[j].name));
-		kv[i++] = UINT2NUM(*(zuint16 *)(void *)((char *)z80 + uint16_members[j++].offset));
-		}
+static VALUE System__add(int argc, VALUE *argv, VALUE self)
+	{
+	VALUE object, multiplier, divisor;
+	SystemCPU *cpu;
+	GET_SYSTEM;
+
+	rb_scan_args(argc, argv, "12", &object, &multiplier, &divisor);
+	if (system->current != NULL) rb_raise(rb_eRuntimeError, "cannot add a CPU to a running system");
+	REALLOC_N(system->cpus, SystemCPU, system->cpu_count + 1);
+	cpu = system->cpus + system->cpu_count;
+	TypedData_Get_Struct(object, Z80, &z80_data_type, cpu->z80);
+	cpu->multiplier = multiplier == Qnil ? 1 : NUM2SIZET(multiplier);
+	cpu->divisor	= divisor    == Qnil ? 1 : NUM2SIZET(divisor);
+	cpu->remainder	= cpu->overrun = 0;
+	if (!cpu->divisor) rb_raise(rb_eZeroDivError, "divided by 0");
+	cpu->object = Qnil;
+	RB_OBJ_WRITE(self, &cpu->object, object);
+	system->cpu_count++;
+	return self;
+	}
 
-	for (j = 0; j < uint8_member_count;)
-		{
-		kv[i++] = rb_id2sym(rb_intern(uint8_members[j].name));
-		kv[i++] = UINT2NUM(*((zuint8 *)z80 + uint8_members[j++].offset));
-		}
 
-	while (j < Z_ARRAY_SIZE(uint8_members))
+static VALUE System__cpus(VALUE self)
+	{
+	VALUE cpus;
+	GET_SYSTEM;
+
+	cpus = rb_ary_new_capa(system->cpu_count);
+	for (zusize i = 0; i < system->cpu_count; i++) rb_ary_push(cpus, system->cpus[i].object);
+	return cpus;
+	}
+
+
+typedef struct {
+	System* system;
+	zusize	ticks;
+} SystemRun;
+
+
+static VALUE system_run(VALUE argument)
+	{
+	System *system = ((SystemRun *)argument)->system;
+	zusize total = ((SystemRun *)argument)->ticks, elapsed = 0;
+
+	while (elapsed < total && !system->terminated)
 		{
-		kv[i++] = rb_id2sym(rb_intern(uint8_members[j].name));
-		kv[i++] = *((zuint8 *)z80 + uint8_members[j++].offset) ? Qtrue : Qfalse;
+		zusize slice = total - elapsed;
+
+		if (slice > system->quantum) slice = system->quantum;
+
+		for (zusize i = 0; i < system->cpu_count && !system->terminated; i++)
+			{
+			SystemCPU *cpu = system->current = system->cpus + i;
+			zusize cycles, executed;
+
+			cpu->remainder += slice * cpu->multiplier;
+			cycles = cpu->remainder / cpu->divisor;
+			cpu->remainder %= cpu->divisor;
+
+			if (cycles <= cpu->overrun)
+				{
+				cpu->overrun -= cycles;
+				continue;
+				}
+
+			cycles -= cpu->overrun;
+			executed = run_z80(cpu->z80, cycles);
+
+			/* A CPU that returns early has been terminated. */
+			if (executed < cycles)
+				{
+				system->terminated = Z_TRUE;
+				cpu->overrun = 0;
+				}
+
+			else cpu->overrun = executed - cycles;
+			}
+
+		elapsed += slice;
+
+		/* Any exception raised here is handled by `system_run_ensure`. */
+		rb_thread_check_ints();
 		}
 
-	rb_hash_bulk_insert_into_st_table(Z_ARRAY_SIZE(kv), kv, hash);
-	return hash;
+	return SIZET2NUM(elapsed);
 	}
 
 
-static char const one_hyphen[2] = "1-";
+static VALUE system_run_ensure(VALUE argument)
+	{
+	((System *)argument)->current = NULL;
+	return Qnil;
+	}
 
 
-static VALUE Z80__print(VALUE self)
+static VALUE System__run(VALUE self, VALUE ticks)
 	{
-	zuint8 f;
-	GET_Z80;
-	f = Z80_F(*z80);
+	SystemRun run;
+	GET_SYSTEM;
+
+	if (system->current != NULL) rb_raise(rb_eRuntimeError, "the system is already running");
+	run.system = system;
+	run.ticks  = NUM2SIZET(ticks);
+	system->terminated = Z_FALSE;
+	return rb_ensure(system_run, (VALUE)&run, system_run_ensure, (VALUE)system);
+	}
 
-	/*
-	PC 0000  AF 0000  AF' 0000  IX 0000
-	SP 0000  BC 0000  BC' 0000  IY 0000
-	IR 0000  DE 0000  DE' 0000  XY 0000
-	WZ 0000  HL 0000  HL' 0000  Q  00
-	S Z Y H X P N C  IFF1 0  IM 0  EI 1
-	- - 1 - - 1 - -  IFF2 0  R7 0  RI 1
-	/INT  high  RS 00  data 00 00 00 00
-	/HALT high  RQ 00  data 00 00 00 00*/
 
-	printf(	"PC %04" PRIX16		   "  AF %04" PRIX16 "  AF' %04" PRIX16 "  IX %04" PRIX16 "\n"
-		"SP %04" PRIX16		   "  BC %04" PRIX16 "  BC' %04" PRIX16 "  IY %04" PRIX16 "\n"
-		"IR %02" PRIX8 "%02" PRIX8 "  DE %04" PRIX16 "  DE' %04" PRIX16 "  XY %04" PRIX16 "\n"
-		"WZ %04" PRIX16		   "  HL %04" PRIX16 "  HL' %04" PRIX16 "  Q  %02" PRIX8  "\n"
-		"S Z Y H X P N C"      "  IFF1 %" PRIu8 "  IM %" PRIu8 "  EI %" PRIu8 "\n"
-		"%c %c %c %c %c %c %c %c  IFF2 %" PRIu8 "  R7 %" PRIu8 "  RI %" PRIu8 "\n",
-		Z80_PC(*z80),	  Z80_AF(*z80), Z80_AF_(*z80), Z80_IX(*z80),
-		Z80_SP(*z80),	  Z80_BC(*z80), Z80_BC_(*z80), Z80_IY(*z80),
-		z80->i, z80->r,	  Z80_DE(*z80), Z80_DE_(*z80), Z80_IX(*z80),
-		Z80_MEMPTR(*z80), Z80_HL(*z80), Z80_HL_(*z80), z80->q,
-		z80->iff1, z80->im, '\0',
-		one_hyphen[!(f & Z80_SF)],
-		one_hyphen[!(f & Z80_ZF)],
-		one_hyphen[!(f & Z80_YF)],
-		one_hyphen[!(f & Z80_HF)],
-		one_hyphen[!(f & Z80_XF)],
-		one_hyphen[!(f & Z80_PF)],
-		one_hyphen[!(f & Z80_NF)],
-		one_hyphen[!(f & Z80_CF)],
-		z80->iff2, z80->r7 >> 7, '\0');
+static VALUE System__terminate(VALUE self)
+	{
+	GET_SYSTEM;
+	system->terminated = Z_TRUE;
+	if (system->current != NULL) z80_break(system->current->z80);
+	return self;
+	}
 
-	return Qnil;
+
+static VALUE System__latch(int argc, VALUE *argv, VALUE self)
+	{
+	VALUE writer, write_port, reader, read_port, interrupt, mask;
+	zuint16 port_mask;
+	Link *link;
+
+	rb_scan_args(argc, argv, "42", &writer, &write_port, &reader, &read_port, &interrupt, &mask);
+	port_mask = mask == Qnil ? 0xFF : (zuint16)NUM2UINT(mask);
+	link = system_add_link(self, reader, interrupt_type(interrupt));
+
+	add_port_handler(
+		writer, (zuint16)NUM2UINT(write_port), port_mask,
+		NULL, (Z80Write)link_write, link, self);
+
+	add_port_handler(
+		reader, (zuint16)NUM2UINT(read_port), port_mask,
+		(Z80Read)link_read, NULL, link, self);
+
+	return self;
 	}
 
 
-/* MARK: - Object Lifecycle */
+static VALUE System__interrupt_line(int argc, VALUE *argv, VALUE self)
+	{
+	VALUE source, port, target, interrupt, mask;
+	zuint8 type;
+	Link *link;
 
-static void Z80__mark(Z80 *z80)
+	rb_scan_args(argc, argv, "32", &source, &port, &target, &interrupt, &mask);
+	type = interrupt == Qnil ? INTInterrupt : interrupt_type(interrupt);
+	if (type == NoInterrupt) type = INTInterrupt;
+	link = system_add_link(self, target, type);
+
+	add_port_handler(
+		source, (zuint16)NUM2UINT(port),
+		mask == Qnil ? 0xFF : (zuint16)NUM2UINT(mask),
+		NULL, (Z80Write)interrupt_line_write, link, self);
+
+	return self;
+	}
+
+
+static void System__mark(System *system)
 	{
-	VALUE *externals = z80->context;
+	for (zusize i = system->cpu_count; i;)
+		rb_gc_mark_movable(system->cpus[--i].object);
 
-	for (int i = 18; i;) if (externals[--i] != Qnil)
-		rb_gc_mark_movable(externals[i]);
+	for (zusize i = system->link_count; i;)
+		rb_gc_mark_movable(system->links[--i]->target);
 	}
 
 
-static void Z80__free(Z80 *z80)
+static void System__free(System *system)
 	{
-	free(z80->context);
-	xfree(z80);
+	for (zusize i = system->link_count; i;) xfree(system->links[--i]);
+	xfree(system->links);
+	xfree(system->cpus);
+	xfree(system);
 	}
 
 
-static size_t Z80__memsize(const void *z80)
-	{return sizeof(Z80) + sizeof(VALUE[18]);}
+static size_t System__memsize(const void *system)
+	{
+	System const *s = system;
+
+	return	sizeof(System) +
+		sizeof(SystemCPU) * s->cpu_count +
+		(sizeof(Link *) + sizeof(Link)) * s->link_count;
+	}
 
 
-static void Z80__compact(Z80 *z80)
+static void System__compact(System *system)
 	{
-	VALUE *externals = z80->context;
+	for (zusize i = system->cpu_count; i;)
+		{
+		SystemCPU *cpu = system->cpus + --i;
+		cpu->object = rb_gc_location(cpu->object);
+		}
 
-	for (int i = 18; i;) if (externals[--i] != Qnil)
-		externals[i] = rb_gc_location(externals[i]);
+	for (zusize i = system->link_count; i;)
+		{
+		Link *link = system->links[--i];
+		link->target = rb_gc_location(link->target);
+		}
 	}
 
 
-static rb_data_type_t const z80_data_type = {
-	.wrap_struct_name = "z80",
+static rb_data_type_t const system_data_type = {
+	.wrap_struct_name = "z80_system",
 	.function = {
 #		if defined(RUBY_API_VERSION_MAJOR) && RUBY_API_VERSION_MAJOR >= 3
-			.dcompact = (void (*)(void *))Z80__compact,
+			.dcompact = (void (*)(void *))System__compact,
 #		endif
-		.dmark = (void (*)(void *))Z80__mark,
-		.dfree = (void (*)(void *))Z80__free,
-		.dsize = NULL},
-	.flags = RUBY_TYPED_FREE_IMMEDIATELY};
+		.dmark = (void (*)(void *))System__mark,
+		.dfree = (void (*)(void *))System__free,
+		.dsize = System__memsize},
+	.flags = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED};
 
 
-static VALUE Z80__alloc(VALUE klass)
+static VALUE System__alloc(VALUE klass)
+	{
+	System *system;
+	VALUE object = TypedData_Make_Struct(klass, System, &system_data_type, system);
+
+	system->cpus	   = NULL;
+	system->cpu_count  = 0;
+	system->links	   = NULL;
+	system->link_count = 0;
+	system->quantum	   = 64;
+	system->current	   = NULL;
+	system->terminated = Z_FALSE;
+	return object;
+	}
+
+
+/* MARK: - C API */
+
+static Z80 *c_api_z80(VALUE object)
 	{
 	Z80 *z80;
-	VALUE object = TypedData_Make_Struct(klass, Z80, &z80_data_type, z80);
-	VALUE *externals = z80->context = malloc(sizeof(VALUE[18]));
 
-	for (int i = 18; i;) externals[--i] = Qnil;
+	TypedData_Get_Struct(object, Z80, &z80_data_type, z80);
+	return z80;
+	}
 
-	z80->options	  = Z80_MODEL_ZILOG_NMOS;
-	z80->fetch_opcode =
-	z80->fetch	  =
-	z80->read	  = dummy_read;
-	z80->write	  =
-	z80->out	  = dummy_write;
-	z80->in		  = dummy_in;
-	z80->halt	  = NULL;
-	z80->nop	  =
-	z80->nmia	  =
-	z80->inta	  =
-	z80->int_fetch	  =
-	z80->hook	  = NULL;
-	z80->ld_i_a	  =
-	z80->ld_r_a	  =
-	z80->reti	  =
-	z80->retn	  = NULL;
-	z80->illegal	  = NULL;
 
-	return object;
+static void c_api_set_handler(
+	VALUE object,
+	int   callback,
+	void* function,
+	void* context,
+	VALUE owner
+)
+	{
+	Bindings *bindings;
+	NativeHandler *handler;
+	Z80 *z80 = c_api_z80(object);
+
+	if (callback < 0 || callback >= Context)
+		rb_raise(rb_eArgError, "invalid callback slot: %d", callback);
+
+	bindings = z80->context;
+
+	if (bindings->native_handlers == NULL)
+		{
+		if (function == NULL) return;
+		bindings->native_handlers = ALLOC_N(NativeHandler, Context);
+
+		for (int i = Context; i;)
+			{
+			handler = bindings->native_handlers + --i;
+			handler->function = handler->context = NULL;
+			handler->owner = Qnil;
+			}
+		}
+
+	handler = bindings->native_handlers + callback;
+	handler->function = function;
+	handler->context  = function != NULL ? context : NULL;
+	RB_OBJ_WRITE(object, &handler->owner, function != NULL ? owner : Qnil);
+	update_callback(z80, (zuint)callback);
+	}
+
+
+static void c_api_map_handler(
+	VALUE	 object,
+	zuint16	 address,
+	zusize	 size,
+	Z80Read	 read,
+	Z80Write write,
+	void*	 context,
+	VALUE	 owner
+)
+	{
+	Z80 *z80 = c_api_z80(object);
+
+	check_page_range(address, size);
+
+	for (zusize i = 0; i < size / MEMORY_PAGE_SIZE; i++)
+		{
+		MemoryPage *page = map_page(object, address / MEMORY_PAGE_SIZE + i, owner);
+
+		page->reader  = read != NULL ? read : dummy_read;
+		page->writer  = write;
+		page->context = context;
+		}
+
+	update_memory_bridges(z80);
+	}
+
+
+static void c_api_remove_handlers(VALUE object, VALUE owner)
+	{
+	Z80 *z80 = c_api_z80(object);
+	Bindings *bindings = z80->context;
+
+	if (bindings->native_handlers != NULL)
+		for (int i = 0; i < Context; i++)
+			if (	bindings->native_handlers[i].function != NULL &&
+				bindings->native_handlers[i].owner == owner
+			)
+				c_api_set_handler(object, i, NULL, NULL, Qnil);
+
+	if (bindings->memory_pages != NULL)
+		{
+		for (int i = 0; i < 256; i++)
+			if (	bindings->memory_pages[i].reader != NULL &&
+				bindings->memory_pages[i].owner == owner
+			)
+				unmap_page(bindings, i);
+
+		release_memory_pages(bindings);
+		update_memory_bridges(z80);
+		}
+
+	remove_port_handlers(z80, owner);
 	}
 
 
+static Z80RubyAPI const c_api = {
+	.version	  = Z80_RUBY_API_VERSION,
+	.z80		  = c_api_z80,
+	.set_handler	  = c_api_set_handler,
+	.add_port_handler = add_port_handler,
+	.map_handler	  = c_api_map_handler,
+	.remove_handlers  = c_api_remove_handlers};
+
+
+static rb_data_type_t const c_api_data_type = {
+	.wrap_struct_name = "z80_c_api",
+	.function = {
+		.dmark = NULL,
+		.dfree = NULL,
+		.dsize = NULL},
+	.flags = RUBY_TYPED_FREE_IMMEDIATELY};
+
+
 /* Library Initialization */
 
 void Init_z80(void)
@@ -693,6 +3316,15 @@ void Init_z80(void)
 	rb_define_const(klass, "MINIMUM_CYCLES_PER_STEP", UINT2NUM(Z80_MINIMUM_CYCLES_PER_STEP));
 	rb_define_const(klass, "HOOK",			  UINT2NUM(Z80_HOOK		      ));
 
+	rb_define_const(
+		klass, "C_API",
+		rb_data_typed_object_wrap(rb_cObject, (void *)&c_api, &c_api_data_type));
+
+	/* Size and `String#unpack` format of the events returned by
+	 * `Z80#drain_out_log`: clock cycle, port and value. */
+	rb_define_const(klass, "OUT_EVENT_SIZE",   UINT2NUM(OUT_EVENT_SIZE));
+	rb_define_const(klass, "OUT_EVENT_FORMAT", rb_obj_freeze(rb_str_new_cstr("Q<S<Cx")));
+
 	rb_define_const(klass, "SF", UINT2NUM(Z80_SF));
 	rb_define_const(klass, "ZF", UINT2NUM(Z80_ZF));
 	rb_define_const(klass, "YF", UINT2NUM(Z80_YF));
@@ -832,6 +3464,10 @@ void Init_z80(void)
 	rb_define_method(klass, "nmi",		   Z80__nmi,		 0);
 	rb_define_method(klass, "execute",	   Z80__execute,	 1);
 	rb_define_method(klass, "run",		   Z80__run,		 1);
+	rb_define_method(klass, "run_cooperatively", Z80__run_cooperatively, -1);
+	rb_define_method(klass, "total_cycles",	   Z80__total_cycles,	 0);
+	rb_define_method(klass, "run_realtime",	   Z80__run_realtime,	-1);
+	rb_define_method(klass, "realtime_stats",  Z80__realtime_stats,	 0);
 	rb_define_method(klass, "terminate",	   Z80__terminate,	 0);
 	rb_define_method(klass, "full_r",	   Z80__full_r,		 0);
 	rb_define_method(klass, "refresh_address", Z80__refresh_address, 0);
@@ -839,6 +3475,24 @@ void Init_z80(void)
 	rb_define_method(klass, "out_cycle",	   Z80__out_cycle,	 0);
 	rb_define_method(klass, "to_h",		   Z80__to_h,		-1);
 	rb_define_method(klass, "print",	   Z80__print,		 0);
+	rb_define_method(klass, "attach_input",	   Z80__attach_input,	-1);
+	rb_define_method(klass, "watch_out",	   Z80__watch_out,	-1);
+	rb_define_method(klass, "unwatch_out",	   Z80__unwatch_out,	 0);
+	rb_define_method(klass, "drain_out_log",   Z80__drain_out_log,	 0);
+	rb_define_method(klass, "attach_beeper",   Z80__attach_beeper,	-1);
+	rb_define_method(klass, "detach_beeper",   Z80__detach_beeper,	 0);
+	rb_define_method(klass, "render_beeper",   Z80__render_beeper,	 0);
+	rb_define_method(klass, "start_profiling", Z80__start_profiling, 0);
+	rb_define_method(klass, "stop_profiling",  Z80__stop_profiling,	 0);
+	rb_define_method(klass, "profiling?",	   Z80__profiling_p,	 0);
+	rb_define_method(klass, "profile",	   Z80__profile,	 0);
+	rb_define_method(klass, "profile_collapsed", Z80__profile_collapsed, -1);
+	rb_define_method(klass, "capture_template",  Z80__capture_template,  0);
+	rb_define_method(klass, "reset_to_template", Z80__reset_to_template, 0);
+	rb_define_method(klass, "dirty_pages",	     Z80__dirty_pages,	     0);
+	rb_define_method(klass, "detach_input",	   Z80__detach_input,	 1);
+	rb_define_method(klass, "map",		   Z80__map,		-1);
+	rb_define_method(klass, "unmap",	   Z80__unmap,		-1);
 /*	rb_define_method(klass, "to_s",		   Z80__to_s,		 0);*/
 
 	rb_define_alias(klass, "t",	"cycles"  );
@@ -852,6 +3506,39 @@ void Init_z80(void)
 	rb_define_alias(klass, "vf",	"pf"	  );
 	rb_define_alias(klass, "vf=",	"pf="	  );
 	rb_define_alias(klass, "state", "to_h"	  );
+
+	module = rb_define_class_under(klass, "Memory", rb_cObject);
+	rb_define_alloc_func(module, Memory__alloc);
+	rb_define_const(module, "PAGE_SIZE", UINT2NUM(MEMORY_PAGE_SIZE));
+	rb_define_method(module, "initialize", Memory__initialize, -1);
+	rb_define_method(module, "size",       Memory__size,	    0);
+	rb_define_method(module, "[]",	       Memory__get,	    1);
+	rb_define_method(module, "[]=",	       Memory__set,	    2);
+	rb_define_method(module, "read",       Memory__read,	    2);
+	rb_define_method(module, "write",      Memory__write,	    2);
+
+	module = rb_define_class_under(klass, "System", rb_cObject);
+	rb_define_alloc_func(module, System__alloc);
+	rb_define_method(module, "initialize",	   System__initialize,	   -1);
+	rb_define_method(module, "quantum",	   System__quantum,	    0);
+	rb_define_method(module, "quantum=",	   System__set_quantum,	    1);
+	rb_define_method(module, "add",		   System__add,		   -1);
+	rb_define_method(module, "cpus",	   System__cpus,	    0);
+	rb_define_method(module, "run",		   System__run,		    1);
+	rb_define_method(module, "terminate",	   System__terminate,	    0);
+	rb_define_method(module, "latch",	   System__latch,	   -1);
+	rb_define_method(module, "interrupt_line", System__interrupt_line, -1);
+
+	klass = rb_define_class_under(klass, "InputQueue", rb_cObject);
+	rb_define_alloc_func(klass, InputQueue__alloc);
+	rb_define_method(klass, "initialize", InputQueue__initialize, -1);
+	rb_define_method(klass, "push",	      InputQueue__push,	      -1);
+	rb_define_method(klass, "<<",	      InputQueue__append,      1);
+	rb_define_method(klass, "size",	      InputQueue__size,	       0);
+	rb_define_method(klass, "empty?",     InputQueue__empty_p,     0);
+	rb_define_method(klass, "clear",      InputQueue__clear,       0);
+	rb_define_method(klass, "on_empty",   InputQueue__on_empty,    0);
+	rb_define_method(klass, "on_empty=",  InputQueue__set_on_empty, 1);
 	}
 
 
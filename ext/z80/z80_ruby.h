@@ -0,0 +1,152 @@
+/*     ______  ______ ______
+      /\___  \/\  __ \\  __ \
+ ____ \/__/  /\_\  __ \\ \/\ \ ______________________________________
+|        /\_____\\_____\\_____\                                      |
+|  Zilog \/_____//_____//_____/ CPU Emulator - Ruby Binding          |
+|  Copyright (C) 2023-2024 Manuel Sainz de Baranda y Goñi.           |
+|                                                                    |
+|  Permission to use, copy, modify, and/or distribute this software  |
+|  for any purpose with or without fee is hereby granted.            |
+|                                                                    |
+|  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL     |
+|  WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED     |
+|  WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL      |
+|  THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR        |
+|  CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM    |
+|  LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,   |
+|  NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN         |
+|  CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.          |
+|                                                                    |
+'===================================================================*/
+
+#ifndef Z80_RUBY_H
+#define Z80_RUBY_H
+
+#include <ruby.h>
+#include <Z80.h>
+#include <string.h>
+
+/* C API for native devices implemented in other extensions.
+ *
+ * The API is a table of function pointers published by the `z80` extension
+ * through the `Z80::C_API` constant. Get it with `z80_ruby_api()`, which
+ * requires the gem if needed and checks that the table is compatible with the
+ * version of this header. New functions are only ever appended to the table,
+ * and `Z80_RUBY_API_VERSION` is increased whenever that happens.
+ *
+ * Handlers receive the context pointer they were registered with instead of
+ * the `context` of the `Z80` object, which belongs to the binding and must not
+ * be modified. Every handler is registered together with an owner object that
+ * the `Z80` object keeps alive (and marks) for as long as the handler remains
+ * installed; pass `Qnil` if the context does not depend on a Ruby object.
+ * Conversely, a device that keeps the `Z80 *` returned by `z80` must keep a
+ * reference to the Ruby object it was obtained from. */
+
+#define Z80_RUBY_API_VERSION 1
+
+/* Callback slots, in the same order as the callback accessors of `Z80`. */
+
+enum {	Z80_RUBY_FETCH_OPCODE,
+	Z80_RUBY_FETCH,
+	Z80_RUBY_READ,
+	Z80_RUBY_WRITE,
+	Z80_RUBY_IN,
+	Z80_RUBY_OUT,
+	Z80_RUBY_HALT,
+	Z80_RUBY_NOP,
+	Z80_RUBY_NMIA,
+	Z80_RUBY_INTA,
+	Z80_RUBY_INT_FETCH,
+	Z80_RUBY_LD_I_A,
+	Z80_RUBY_LD_R_A,
+	Z80_RUBY_RETI,
+	Z80_RUBY_RETN,
+	Z80_RUBY_HOOK,
+	Z80_RUBY_ILLEGAL,
+	Z80_RUBY_CALLBACK_COUNT
+};
+
+/* The illegal instruction handler takes a context pointer rather than the
+ * `Z80 *` that `Z80Illegal` receives. Handlers for the other slots use the
+ * callback types of the Z80 library. */
+
+typedef zuint8 (* Z80RubyIllegal)(void *context, zuint8 opcode);
+
+typedef struct {
+	unsigned int version;
+
+	/* Returns the emulator instance of a `Z80` object, or raises `TypeError`. */
+	Z80 *(* z80)(VALUE object);
+
+	/* Installs a native handler in a callback slot, replacing the Ruby
+	 * callback of that slot (if any) until it is removed. `function` must
+	 * be of the type that corresponds to `callback`; passing NULL removes
+	 * the handler. Memory and port handlers are still preceded by the pages
+	 * mapped with `Z80#map` and by the port handlers, respectively. */
+	void (* set_handler)(
+		VALUE object,
+		int   callback,
+		void* function,
+		void* context,
+		VALUE owner);
+
+	/* Attaches a native device to the I/O ports for which
+	 * `(port & mask) == (port_value & mask)`. Either `in` or `out` can be
+	 * NULL. Port handlers are tried in the order they were added. */
+	void (* add_port_handler)(
+		VALUE	 object,
+		zuint16	 port,
+		zuint16	 mask,
+		Z80Read	 in,
+		Z80Write out,
+		void*	 context,
+		VALUE	 owner);
+
+	/* Maps a native memory device into the address space. `address` and
+	 * `size` must be multiples of 256 (the page size). `read` serves the
+	 * opcode fetches, fetches and reads of the pages; `write` can be NULL
+	 * to ignore the writes. */
+	void (* map_handler)(
+		VALUE	 object,
+		zuint16	 address,
+		zusize	 size,
+		Z80Read	 read,
+		Z80Write write,
+		void*	 context,
+		VALUE	 owner);
+
+	/* Removes every handler registered with the given owner. */
+	void (* remove_handlers)(VALUE object, VALUE owner);
+} Z80RubyAPI;
+
+
+static inline Z80RubyAPI const *z80_ruby_api(void)
+	{
+	static Z80RubyAPI const *api = NULL;
+
+	if (api == NULL)
+		{
+		VALUE object;
+
+		rb_require("z80");
+
+		object = rb_const_get(
+			rb_const_get(rb_cObject, rb_intern("Z80")),
+			rb_intern("C_API"));
+
+		if (	!RB_TYPE_P(object, T_DATA) || !RTYPEDDATA_P(object) ||
+			strcmp(RTYPEDDATA_TYPE(object)->wrap_struct_name, "z80_c_api")
+		)
+			rb_raise(rb_eTypeError, "Z80::C_API is not a C API table");
+
+		if (((Z80RubyAPI const *)RTYPEDDATA_DATA(object))->version < Z80_RUBY_API_VERSION)
+			rb_raise(rb_eLoadError, "the installed z80 gem is too old for this extension");
+
+		api = RTYPEDDATA_DATA(object);
+		}
+
+	return api;
+	}
+
+
+#endif /* Z80_RUBY_H */